@@ -1,114 +1,259 @@
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#ifndef CHIP8_HEADLESS
 #include <SDL2/SDL.h>
+#endif
+#ifdef _WIN32
 #include <windows.h>
-
-//Chip 8 System Struct
-struct Chip8System {
-    //Memory (The Chip-8 has 4 Kb, or 4096 bytes)
-    uint8_t Chip8Memory[4096];
-
-    //Program Counter and Index Register Initilization
-    uint16_t I = 0; //The PC and Index Register can actually only address 12 bits
-    uint16_t PC = 0x200; //First location of memory allocated for Chip8 should be loaded into x200.
-    uint16_t SP = 15; //Defaults to top of the stack
-
-    //Register Initilization (V0-VF)
-    uint8_t V[16]; //Its better to use this an array rather than a bunch of variables since it is easier to manage.
-
-    //Timers Initilization
-    uint8_t DelayTimer, SoundTimer = 0;
-
-    //Stack
-    uint16_t Stack[16]; //Limited Stack Space
-
-    //Display
-    uint8_t Chip8Display[64][32]; //The display only needs each pixel to be on or off, so it is better to use the smallest variable possible.
-    uint8_t DisplayUpdate = 0; //The flag only needs to be on or off, so it is better to use the smallest variable possible.
-
-    //Keypad State; Each Key is either on or off.
-    uint8_t Chip8KeyPad[16];
-    uint8_t keymap[16] = { 
-    //Keymap for the Chip-8 system
-    SDLK_1, SDLK_2, SDLK_3, SDLK_4, //Key Presses 1, 2, 3, C
-    SDLK_q, SDLK_w, SDLK_e, SDLK_r, //Key Presses 4, 5, 6, D
-    SDLK_a, SDLK_s, SDLK_d, SDLK_f, //Key Presses 7, 8, 9, E
-    SDLK_z, SDLK_x, SDLK_c, SDLK_v  //Key Presses A, 0, B, F
-}; 
-
-    //Font, will be loaded into memory locations 0x050 to 0x09F
-    uint8_t FONT[80] {
-    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-    0x20, 0x60, 0x20, 0x20, 0x70, // 1
-    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-    };
-
-    //Display Variables
-    int WIDTH = 64, HEIGHT = 32, scalefactor;
-};
-
-//System Function Declarations
-void Chip8DisplayOut(Chip8System *Chip8, SDL_Renderer *renderer);
-void Chip8Init(Chip8System *Chip8);
-void Chip8CPU(Chip8System *Chip8, uint16_t opcode);
-void Chip8UpdateTimers(Chip8System *Chip8);
-void Chip8Keyboard(Chip8System *Chip8);
+#include <mmsystem.h>
+#else
+#include <sys/mman.h>
+#include <time.h>
+#include <cerrno>
+#endif
+#include "chip8.h"
+
+//The JIT core compiles to x86-64 code, other hosts use the block translator in its place.
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT_AVAILABLE 1
+#endif
+
+//How long before a deadline Chip8SleepUntil stops sleeping and spins, a little more than the OS timer can oversleep by.
+#ifdef _WIN32
+#define CHIP8_SPIN_NS 2000000
+#else
+#define CHIP8_SPIN_NS 1000000
+#endif
+
+int Chip8Benchmark(int argc, char *argv[]);
 
 //I tried to minimize the amount of global variables as much as possible.
 //However the scale factor, width, and height variables would break the program when included in the struct.
 
 int main(int argc, char *argv[]) 
 {
+#ifdef CHIP8_BENCHMARK
+    return Chip8Benchmark(argc, argv);
+#endif
     //Initilize system.
-    Chip8System Chip8;
+    Chip8System Chip8 {}; //Value initialized, so members without a default start at zero
+
+    Chip8Init(&Chip8, argc, argv);
+    if (Chip8.Headless) {
+        if (Chip8.Resume) {
+            Chip8StateSlot(&Chip8, 0, false);
+        }
+        int Result = Chip8RunHeadless(&Chip8);
+        Chip8FreeJit(&Chip8);
+        return Result;
+    }
 
-    Chip8Init(&Chip8);
+#ifndef CHIP8_HEADLESS
+#ifdef _WIN32
+    //Ask for a 1 ms scheduler tick, at the default 15.6 ms the Sleep in Chip8SleepUntil would oversleep far past its spin margin.
+    timeBeginPeriod(1);
+#endif
     //SDL initilization and window + Renderer creation
     SDL_Init(SDL_INIT_EVERYTHING);
     SDL_Window *window = SDL_CreateWindow("Chip-8 Emulator", SDL_WINDOWPOS_UNDEFINED,SDL_WINDOWPOS_UNDEFINED, Chip8.WIDTH, Chip8.HEIGHT, SDL_WINDOW_ALLOW_HIGHDPI);
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, 0);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, Chip8.Renderer == CHIP8_RENDER_SOFTWARE ? SDL_RENDERER_SOFTWARE : 0);
+    Chip8DisplayInit(&Chip8, renderer);
     
-    //Run code in loop,.
-    while (true) {
-        //Fetch Opcode
-        uint16_t Opcode = Chip8.Chip8Memory[Chip8.PC] << 8 | Chip8.Chip8Memory[Chip8.PC + 1]; //Opcode is 2 bytes long, so we need to combine the two bytes into one 16 bit number.
-        
-        //Fetech Key Press
-        Chip8Keyboard(&Chip8);
+    //Emulation runs on its own thread, this one handles SDL events and presents the frames it publishes.
+    //A slow present or a window drag only delays the picture, never the guest's timing.
+    Chip8Shared Shared;
+    Chip8.Shared = &Shared;
+    SDL_AudioDeviceID Audio = Chip8AudioInit(&Chip8);
+
+    //Pick up where the last session left off, instead of booting the ROM again.
+    //Loaded once the audio ring exists, so a state saved with the tone on starts it again.
+    if (Chip8.Resume) {
+        Chip8StateSlot(&Chip8, 0, false);
+    }
+    SDL_Thread *Emulation = SDL_CreateThread(Chip8EmulationThread, "Chip-8 Emulation", &Chip8);
 
-        //Decode and exectute Opcode
-        Chip8CPU(&Chip8, Opcode);
+    uint64_t NextFrame = Chip8Now() + CHIP8_FRAME_NS;
+    while (Shared.Running) {
+        Chip8Keyboard(&Chip8);
 
-        //Check if display needs to be updated.
-        if (Chip8.DisplayUpdate) {
-            Chip8DisplayOut(&Chip8, renderer);
+        //Present at most once per frame, and only the rows that differ from the frame on screen.
+        //The emulation thread only publishes frames that changed, so a static screen costs nothing here.
+        if (Chip8TakeFrame(&Shared) || !Shared.ShownValid) {
+            const uint64_t *Frame = Shared.Frames[Shared.Front];
+            uint32_t Rows = 0;
+            for (int y = 0; y < 32; y++) {
+                Rows |= (uint32_t)(!Shared.ShownValid || Frame[y] != Shared.Shown[y]) << y;
+                Shared.Shown[y] = Frame[y];
+            }
+            Shared.ShownValid = true;
+            if (Rows != 0) {
+                Chip8DisplayOut(&Chip8, renderer, Frame, Rows);
+                Chip8RecordLatency(&Shared, &Shared.FrameProbes[Shared.Front], Chip8Now());
+            }
         }
 
-        Chip8UpdateTimers(&Chip8);
-        Chip8.PC += 2; //Increment PC by 2, since each opcode is 2 bytes long.
+        Chip8WaitFrame(&NextFrame, nullptr);
+    }
 
-        //Wait for 60 hz
-        SDL_Delay(16); //Roughly 16 ms, 60 hz is 16.66 ms, but this is rather close.
+    SDL_WaitThread(Emulation, nullptr);
+    if (Chip8.Resume) {
+        Chip8StateSlot(&Chip8, 0, true);
+    }
+    if (Chip8.PaceLog != nullptr) {
+        Chip8ReportPacing(&Shared, Chip8.PaceLog);
     }
+    if (Shared.Latency.Count > 0) {
+        Chip8ReportLatency(&Shared);
+    }
+    if (Audio != 0) {
+        SDL_CloseAudioDevice(Audio);
+    }
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    Chip8FreeJit(&Chip8);
+#ifdef _WIN32
+    timeEndPeriod(1);
+#endif
+#endif
     return EXIT_SUCCESS;
 };
 
-void Chip8Init(Chip8System *Chip8) {
-    //Local Variables
-    std::string ROMName;
+//Reads a whole decimal (or hex, with Base 16) number, false if Text is anything else.
+static bool Chip8ArgNumber(const char *Text, long long *Value, int Base = 10) {
+    char *End;
+    *Value = strtoll(Text, &End, Base);
+    return *Text != '\0' && *End == '\0' && *Value >= 0;
+}
+
+static void Chip8Usage(const char *Program) {
+    std::cout << "Usage: " << Program << " [options] ROM" << std::endl
+        << "Run with no arguments to be asked for each setting instead." << std::endl
+        << "  --scale N              Pixel size, the window is 64N x 32N (default 10)" << std::endl
+        << "  --ips N                Instructions per second, 0 for as fast as possible (default 700)" << std::endl
+        << "  --core N               CPU core, 0 table, 1 threaded, 2 cached, 3 blocks, 4 JIT, 5 JIT verify, 6 AOT (default 0)" << std::endl
+        << "  --quirks ID            Quirk profile, vip, chip48, schip or xochip (default from the ROM's extension)" << std::endl
+        << "  --colors ON OFF        Pixel colors as RRGGBB hex (default FFFFFF 000000)" << std::endl
+        << "  --renderer NAME        texture, rects or software (default texture)" << std::endl
+        << "  --audio-sync           Pace frames by the audio device's clock" << std::endl
+        << "  --tone HZ              Pitch of the sound (default 1030)" << std::endl
+        << "  --volume PERCENT       Volume of the sound (default 25)" << std::endl
+        << "  --keymap FILE          Key mapping file (default keymap.txt, if there is one)" << std::endl
+        << "  --frames N             Exit after N frames" << std::endl
+        << "  --cycles N             Exit after N instructions" << std::endl
+        << "  --exit-on-halt         Exit when the ROM jumps to itself" << std::endl
+        << "  --exit-on-keywait      Exit when the ROM waits for a key with Fx0A" << std::endl
+        << "  --break ADDR           Exit when PC reaches ADDR (hex), can be given more than once" << std::endl
+        << "  --pace-log FILE        Write how late each frame started to FILE (CSV) on exit, with a summary" << std::endl
+        << "  --resume               Load the ROM's resume state (ROM.state0) at startup if there is one, and save it on exit" << std::endl
+        << "  --headless             No window, sound or pacing, run flat out and print the final state (stops on a halt or key wait)" << std::endl
+        << "Keys: F1 to F9 load save state slots 1 to 9, Shift+F1 to F9 save them, F12 prints the input latency." << std::endl;
+}
+
+//Reads the command line into Chip8, ROMName, Quirks (-1 to pick it from the ROM's extension) and Keymap.
+//Anything not given keeps its default. Returns false on an unknown option or a bad value.
+static bool Chip8ParseArgs(Chip8System *Chip8, int argc, char *argv[], std::string &ROMName, int &Quirks, std::string &Keymap) {
+    Chip8->scalefactor = 10;
+    for (int a = 1; a < argc; a++) {
+        std::string Option = argv[a];
+        long long Value = 0;
+        bool HasValue = a + 1 < argc;
+
+        if (Option[0] != '-') {
+            ROMName = Option;
+        }
+        else if (Option == "--scale" && HasValue && Chip8ArgNumber(argv[++a], &Value) && Value >= 1 && Value <= 1000) {
+            Chip8->scalefactor = (int)Value;
+        }
+        else if (Option == "--ips" && HasValue && Chip8ArgNumber(argv[++a], &Value) && Value <= 1000000000) {
+            Chip8->IPS = (int)Value;
+        }
+        else if (Option == "--core" && HasValue && Chip8ArgNumber(argv[++a], &Value) && Value <= CHIP8_CORE_AOT) {
+            Chip8->CPUCore = (int)Value;
+        }
+        else if (Option == "--quirks" && HasValue && Chip8QuirksById(argv[a + 1]) >= 0) {
+            Quirks = Chip8QuirksById(argv[++a]);
+        }
+        else if (Option == "--colors" && a + 2 < argc) {
+            long long Off;
+            if (!Chip8ArgNumber(argv[a + 1], &Value, 16) || !Chip8ArgNumber(argv[a + 2], &Off, 16) || Value > 0xFFFFFF || Off > 0xFFFFFF) {
+                return false;
+            }
+            Chip8->OnColor = (uint32_t)Value;
+            Chip8->OffColor = (uint32_t)Off;
+            a += 2;
+        }
+        else if (Option == "--renderer" && HasValue) {
+            std::string Name = argv[++a];
+            if (Name == "texture") {
+                Chip8->Renderer = CHIP8_RENDER_TEXTURE;
+            }
+            else if (Name == "rects") {
+                Chip8->Renderer = CHIP8_RENDER_RECTS;
+            }
+            else if (Name == "software") {
+                Chip8->Renderer = CHIP8_RENDER_SOFTWARE;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (Option == "--audio-sync") {
+            Chip8->AudioSync = 1;
+        }
+        else if (Option == "--tone" && HasValue && Chip8ArgNumber(argv[++a], &Value) && Value >= 20 && Value <= 20000) {
+            Chip8->ToneHz = (int)Value;
+        }
+        else if (Option == "--volume" && HasValue && Chip8ArgNumber(argv[++a], &Value) && Value <= 100) {
+            Chip8->Volume = (int)Value;
+        }
+        else if (Option == "--keymap" && HasValue) {
+            Keymap = argv[++a];
+        }
+        else if (Option == "--frames" && HasValue && Chip8ArgNumber(argv[++a], &Value)) {
+            Chip8->MaxFrames = Value;
+        }
+        else if (Option == "--cycles" && HasValue && Chip8ArgNumber(argv[++a], &Value)) {
+            Chip8->MaxCycles = Value;
+        }
+        else if (Option == "--exit-on-halt") {
+            Chip8->ExitOnHalt = true;
+        }
+        else if (Option == "--exit-on-keywait") {
+            Chip8->ExitOnKeyWait = true;
+        }
+        else if (Option == "--pace-log" && HasValue) {
+            Chip8->PaceLog = argv[++a];
+        }
+        else if (Option == "--resume") {
+            Chip8->Resume = true;
+        }
+        else if (Option == "--headless") {
+            Chip8->Headless = true;
+        }
+        else if (Option == "--break" && HasValue && Chip8ArgNumber(argv[++a], &Value, 16) && Value <= 0xFFF) {
+            Chip8SetBreakpoint(Chip8, (uint16_t)Value, true);
+        }
+        else {
+            std::cout << "Bad option or value: " << Option << std::endl;
+            return false;
+        }
+    }
+    return !ROMName.empty();
+}
+
+//Asks for each setting and the ROM on the console, for launches without any arguments.
+//Builds without SDL have no window or sound, so they only ask for the speed, the core and the ROM.
+static void Chip8Prompt(Chip8System *Chip8, std::string &ROMName) {
+#ifndef CHIP8_HEADLESS
     //Set up scale factor system
     //This scale factor system enables users to implement whatever resolution requirements they have.
     std::cout << "Please enter the scale factor for the Chip-8 System." << std::endl << "Common Scale Factors are 10x for 640x320, 20x for 1280x640, 30x for 1920x960, 40x for 2560x1280, and 60x for 3840x1920." << std::endl << "Please note that this is what determines pixel size." << std::endl;
@@ -118,6 +263,71 @@ void Chip8Init(Chip8System *Chip8) {
         std::cout << "Please enter a valid number greater than zero." << std::endl;
         std::cin >> Chip8->scalefactor;
     }
+#endif
+
+    //Set up CPU speed, timers and the display always run at 60 hz, this only changes how many instructions run per frame.
+    std::cout << "Please enter the number of instructions per second." << std::endl << "Most games are meant to run between 500 and 2000, 700 is a good default. Enter 0 to run as fast as possible." << std::endl;
+    std::cin >> Chip8->IPS;
+
+    while (Chip8->IPS < 0) {
+        std::cout << "Please enter a number that is zero or greater." << std::endl;
+        std::cin >> Chip8->IPS;
+    }
+
+#ifndef CHIP8_HEADLESS
+    //Pick the timing source, the audio clock keeps long sessions from drifting against the sound.
+    std::cout << "Please select the timing source." << std::endl << "0 to pace frames with the system timer, 1 to follow the audio device's clock (keeps sound and video in step over long sessions)." << std::endl;
+    std::cin >> Chip8->AudioSync;
+
+    while (Chip8->AudioSync != 0 && Chip8->AudioSync != 1) {
+        std::cout << "Please enter 0 or 1." << std::endl;
+        std::cin >> Chip8->AudioSync;
+    }
+#endif
+
+    //Pick the CPU core, they all behave the same, the threaded one is usually faster on GCC and Clang builds.
+    std::cout << "Please select the CPU core." << std::endl << "0 for the table interpreter, 1 for the threaded interpreter, 2 for the pre-decoded cache interpreter, 3 for the basic block translator," << std::endl << "4 for the x86-64 JIT, 5 for the JIT checked against the interpreter (slow, for debugging), 6 for code compiled ahead of time (make aot)." << std::endl;
+    std::cin >> Chip8->CPUCore;
+
+    while (Chip8->CPUCore < CHIP8_CORE_TABLE || Chip8->CPUCore > CHIP8_CORE_AOT) {
+        std::cout << "Please enter a number from 0 to 6." << std::endl;
+        std::cin >> Chip8->CPUCore;
+    }
+
+#ifndef CHIP8_HEADLESS
+    //Pixel colors, read as hex so they can be copied straight out of a paint program.
+    std::cout << "Please enter the colors for pixels that are on and off, as RRGGBB hex values." << std::endl << "FFFFFF 000000 is white on black." << std::endl;
+    std::cin >> std::hex >> Chip8->OnColor >> Chip8->OffColor >> std::dec;
+
+    while (!std::cin || Chip8->OnColor > 0xFFFFFF || Chip8->OffColor > 0xFFFFFF) {
+        std::cin.clear();
+        std::cin.ignore(1024, '\n');
+        std::cout << "Please enter two hex values from 000000 to FFFFFF." << std::endl;
+        std::cin >> std::hex >> Chip8->OnColor >> Chip8->OffColor >> std::dec;
+    }
+#endif
+
+    //Get Rom File from User
+    std::cout << "Please enter the file name of your ROM file." << std::endl << "Please include the .ch8 at the end! " << std::endl;
+    std::cin >> ROMName;
+}
+
+void Chip8Init(Chip8System *Chip8, int argc, char *argv[]) {
+    //Local Variables
+    std::string ROMName;
+    std::string Keymap = "keymap.txt";
+    int Quirks = -1;
+
+    //Scripts pass everything on the command line, the prompts are only for launches without any arguments.
+    if (argc > 1) {
+        if (!Chip8ParseArgs(Chip8, argc, argv, ROMName, Quirks, Keymap)) {
+            Chip8Usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        Chip8Prompt(Chip8, ROMName);
+    }
 
     Chip8->WIDTH = 64 * Chip8->scalefactor;
     Chip8->HEIGHT = 32 * Chip8->scalefactor;
@@ -132,25 +342,21 @@ void Chip8Init(Chip8System *Chip8) {
     for (int j = 0; j < 16; j++) {
         Chip8->V[j] = 0;
         Chip8->Stack[j] = 0;
-        Chip8->Chip8KeyPad[j] = 0;
     }
+    Chip8->Chip8KeyPad = 0;
 
     //Clear Display
-    for (int x = 0; x < 64; x++) {
-        for (int y = 0; y < 32; y++) {
-            Chip8->Chip8Display[x][y] = 0; //Set each pixel to off.
-        }
+    for (int y = 0; y < 32; y++) {
+        Chip8->Chip8Display[y] = 0; //Set each pixel in the row to off.
     }
+    Chip8->DisplayUpdate = 1; //Present the blank screen once so the window starts in the off color
+    Chip8->DirtyRows = 0xFFFFFFFF;
 
     //Load font set into memory location 0x50 to 0x9F, (Location 80 and 159)
     for (int f = 80; f < 160; f++) {
         Chip8->Chip8Memory[f] = Chip8->FONT[f-80];
     }
 
-    //Get Rom File from User
-    std::cout << "Please enter the file name of your ROM file." << std::endl << "Please include the .ch8 at the end! " << std::endl;
-    std::cin >> ROMName;
-
     std::ifstream file(ROMName, std::ios::binary);
 
     if (!file.is_open()) {
@@ -174,92 +380,312 @@ void Chip8Init(Chip8System *Chip8) {
     
     //Close Rom
     file.close();
+
+#ifdef CHIP8_HEADLESS
+    //Built without SDL, there is nothing but the headless mode.
+    Chip8->Headless = true;
+#else
+    //Keys from the keymap file if there is one, the default layout otherwise.
+    if (Chip8LoadKeymap(Chip8, Keymap)) {
+        std::cout << "Loaded keys from " << Keymap << "." << std::endl;
+    }
+    else if (Keymap != "keymap.txt") {
+        std::cout << "Unable to open " << Keymap << ", using the default keys." << std::endl;
+    }
+    Chip8BuildKeyLookup(Chip8);
+#endif
+
+    //Pick the quirk profile before anything is decoded, the decoded handlers depend on it.
+    Chip8->Quirks = Quirks >= 0 ? Quirks : Chip8QuirksForRom(ROMName);
+    std::cout << "Running with " << Chip8QuirkProfiles[Chip8->Quirks].Name << " quirks." << std::endl;
+
+    //Nothing has been decoded or translated yet.
+    Chip8ResetDecodeCache(Chip8);
+    Chip8FlushBlocks(Chip8);
+    Chip8LoadAOT(Chip8);
+
+    //Save states are named after the ROM, --resume loads slot 0 once the frontend is up.
+    Chip8->StateName = ROMName;
+}
+
+void Chip8Step(Chip8System *Chip8) {
+    //Fetch Opcode
+    Chip8->PC &= 0xFFF; //Running off the end of memory wraps around to the start
+    uint16_t Opcode = Chip8->Chip8Memory[Chip8->PC] << 8 | Chip8->Chip8Memory[(Chip8->PC + 1) & 0xFFF]; //Opcode is 2 bytes long, so we need to combine the two bytes into one 16 bit number.
+
+    //Decode and exectute Opcode
+    Chip8CPU(Chip8, Opcode);
+    Chip8->PC += 2; //Increment PC by 2, since each opcode is 2 bytes long.
+    return;
+}
+
+#ifndef CHIP8_HEADLESS
+//Renderer
+//The framebuffer is uploaded into one 64x32 streaming texture, already turned into the on and off colors,
+//and drawn with a single SDL_RenderCopy that scales it up to the window.
+//If the renderer can't make the texture, every lit pixel is drawn as its own rectangle instead.
+void Chip8DisplayInit(Chip8System *Chip8, SDL_Renderer *renderer) {
+    if (Chip8->Renderer == CHIP8_RENDER_RECTS) {
+        return;
+    }
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest"); //Keep the pixels square when the texture is scaled
+    Chip8->Texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    if (Chip8->Texture == nullptr) {
+        std::cout << "Unable to create the display texture (" << SDL_GetError() << "), drawing with rectangles instead." << std::endl;
+    }
 }
 
-void Chip8DisplayOut(Chip8System *Chip8, SDL_Renderer *renderer) {
+static void Chip8DisplayOutRects(Chip8System *Chip8, SDL_Renderer *renderer, const uint64_t *Frame) {
     //Reset rendered image, so that the new frame doesn't overlap the old one;
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); //accepts R, G, B, A in that order
+    SDL_SetRenderDrawColor(renderer, Chip8->OffColor >> 16, Chip8->OffColor >> 8, Chip8->OffColor, 255); //accepts R, G, B, A in that order
     SDL_RenderClear(renderer);
 
-    SDL_Rect DisplayOut[64][32];
-    for (int a = 0; a < 64; a++) {
-        for (int b = 0; b < 32; b++) {
-            DisplayOut[a][b].x = a * Chip8->scalefactor; 
-            DisplayOut[a][b].y = b * Chip8->scalefactor;
-            DisplayOut[a][b].w = Chip8->scalefactor;
-            DisplayOut[a][b].h = Chip8->scalefactor;
+    SDL_SetRenderDrawColor(renderer, Chip8->OnColor >> 16, Chip8->OnColor >> 8, Chip8->OnColor, 255);
+    //Render each tile, bit 63 of a row is the leftmost pixel
+    for (int y = 0; y < 32; y++) {
+        for (int x = 0; x < 64; x++) {
+            if ((Frame[y] >> (63 - x)) & 1) {
+                SDL_Rect Pixel = {x * Chip8->scalefactor, y * Chip8->scalefactor, Chip8->scalefactor, Chip8->scalefactor};
+                SDL_RenderFillRect(renderer, &Pixel);
+            }
+        }
+    }
+    SDL_RenderPresent(renderer);
+}
+
+//Returns a mask of the rows (bit y for row y) that differ from the last frame handed to Chip8ChangedRows, and clears the dirty state.
+//Called on the emulation thread to decide whether a frame is worth publishing.
+//Only rows drawn to since then are compared, so a static screen with one small sprite moving costs a few compares per frame.
+//Every row is returned when ShownValid is clear.
+uint32_t Chip8ChangedRows(Chip8System *Chip8) {
+    uint32_t Rows = Chip8->ShownValid ? Chip8->DirtyRows : 0xFFFFFFFF;
+    for (int y = 0; y < 32; y++) {
+        if ((Rows >> y) & 1) {
+            if (Chip8->ShownValid && Chip8->ShownDisplay[y] == Chip8->Chip8Display[y]) {
+                Rows &= ~(1u << y); //Erased and drawn back the same, nothing to show
+            }
+            Chip8->ShownDisplay[y] = Chip8->Chip8Display[y];
         }
     }
+    Chip8->DirtyRows = 0;
+    Chip8->DisplayUpdate = 0;
+    Chip8->ShownValid = 1;
+    return Rows;
+}
+
+void Chip8DisplayOut(Chip8System *Chip8, SDL_Renderer *renderer, const uint64_t *Frame, uint32_t Rows) {
+    if (Chip8->Texture == nullptr) {
+        Chip8DisplayOutRects(Chip8, renderer, Frame);
+        return;
+    }
 
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); //accepts R, G, B, A in that order
-    //Render each tile
-    for (int x = 0; x < 64; x++) {
-        for (int y = 0; y < 32; y++) {
-            switch (Chip8->Chip8Display[x][y]) {
-                case 0:
-                        break;
-                case 1:
-                        SDL_RenderFillRect(renderer, &DisplayOut[x][y]);
-                        break;
+    //Upload each run of changed rows with its own lock, the rest of the texture keeps the last frame.
+    //Pick the color for each pixel without a branch, On ^ Off is masked in only where the bit is set.
+    uint32_t Off = 0xFF000000 | Chip8->OffColor;
+    uint32_t Flip = (0xFF000000 | Chip8->OnColor) ^ Off;
+    for (int First = 0; First < 32; First++) {
+        if (((Rows >> First) & 1) == 0) {
+            continue;
+        }
+        int Last = First;
+        while (Last + 1 < 32 && ((Rows >> (Last + 1)) & 1)) {
+            Last++;
+        }
+
+        SDL_Rect Area = {0, First, 64, Last - First + 1};
+        void *Pixels;
+        int Pitch;
+        if (SDL_LockTexture(Chip8->Texture, &Area, &Pixels, &Pitch) != 0) {
+            Chip8DisplayOutRects(Chip8, renderer, Frame);
+            return;
+        }
+        for (int y = First; y <= Last; y++) {
+            uint32_t *Line = (uint32_t *)((uint8_t *)Pixels + (y - First) * Pitch);
+            uint64_t Row = Frame[y];
+            for (int x = 0; x < 64; x++) {
+                Line[x] = Off ^ (Flip & (0 - (uint32_t)((Row >> (63 - x)) & 1)));
             }
         }
+        SDL_UnlockTexture(Chip8->Texture);
+        First = Last;
     }
+
+    SDL_RenderCopy(renderer, Chip8->Texture, nullptr, nullptr);
     SDL_RenderPresent(renderer);
-    return;
 }
+#endif
 
+//One 60 hz timer tick. The timers count down on their own from Ticks, see Chip8DelayTimer.
 void Chip8UpdateTimers(Chip8System *Chip8) {
-    if (Chip8->DelayTimer > 0) { //Even though timers are supposed to update asynchonously, I don't know how to use multithreading.
-        Chip8->DelayTimer--;
-    }
-    if (Chip8->SoundTimer > 0) {
-        Chip8->SoundTimer--;
-        Beep(1030,16); //16 ms, close enough to 60 hz
-        //Play Sound for exactly one clock cycle.
-        //When sound timer is 0, the sound will not play.
+    Chip8->Ticks++;
+    //The tone stops on the tick the timer runs out, AudioClock is already at the end of this frame.
+    if (Chip8->SoundExpiry == Chip8->Ticks && Chip8->Shared != nullptr) {
+        Chip8PushAudioEvent(Chip8->Shared, Chip8->AudioClock, false);
     }
     return;
 }
 
+//Queues the tone turning on or off at guest cycle Cycle for the audio callback, never blocks.
+//Only the emulation thread may call it, the ring has one producer and one consumer.
+void Chip8PushAudioEvent(Chip8Shared *Shared, uint64_t Cycle, bool On) {
+    if (Shared->ClockHz == 0) {
+        return; //No audio device
+    }
+    uint32_t Head = Shared->AudioHead.load(std::memory_order_relaxed);
+    if (Head - Shared->AudioTail.load(std::memory_order_acquire) == CHIP8_AUDIO_EVENTS) {
+        return; //Full, the callback isn't running
+    }
+    Shared->AudioEvents[Head % CHIP8_AUDIO_EVENTS] = {Cycle, On};
+    Shared->AudioHead.store(Head + 1, std::memory_order_release);
+}
+
+#ifndef CHIP8_HEADLESS
+//Fills SDL's audio buffer on SDL's audio thread, a square wave while the tone is on and silence otherwise.
+//The callback keeps its own guest clock, one sample is ClockHz / SampleRate cycles, and applies each event on the sample its cycle falls on.
+//That clock trails the emulator by CHIP8_AUDIO_LAG frames so events are queued before they are due,
+//and it jumps back in line if the emulator stalls or races more than that far away from it.
+static void Chip8AudioCallback(void *Data, Uint8 *Stream, int Length) {
+    Chip8Shared *Shared = (Chip8Shared *)Data;
+    int16_t *Samples = (int16_t *)Stream;
+    uint64_t Rate = Shared->SampleRate;
+    uint64_t Lag = (uint64_t)Shared->ClockHz * CHIP8_AUDIO_LAG / 60 * Rate; //In the units of AudioPos
+
+    uint64_t Target = Shared->AudioClock.load(std::memory_order_acquire) * Rate;
+    Target = Target > Lag ? Target - Lag : 0;
+    if (Shared->AudioPos + Lag < Target || Shared->AudioPos > Target + Lag) {
+        Shared->AudioPos = Target;
+    }
+
+    uint32_t Head = Shared->AudioHead.load(std::memory_order_acquire);
+    uint32_t Tail = Shared->AudioTail.load(std::memory_order_relaxed);
+    for (int i = 0; i < Length / 2; i++) {
+        while (Tail != Head && Shared->AudioEvents[Tail % CHIP8_AUDIO_EVENTS].Cycle * Rate <= Shared->AudioPos) {
+            Shared->Tone = Shared->AudioEvents[Tail % CHIP8_AUDIO_EVENTS].On;
+            Tail++;
+        }
+        int16_t Level = Shared->Tone ? Shared->Amplitude : 0;
+        Samples[i] = (Shared->Phase & 0x80000000) ? -Level : Level; //High for the first half of each period, low for the second
+        Shared->Phase += Shared->PhaseStep;
+        Shared->AudioPos += Shared->ClockHz;
+    }
+    Shared->AudioTail.store(Tail, std::memory_order_release);
+    Shared->SamplesPlayed.store(Shared->SamplesPlayed.load(std::memory_order_relaxed) + Length / 2, std::memory_order_release);
+}
+
+//Opens the default audio device for the tone set by ToneHz and Volume, returns 0 and leaves the emulator silent if there is none.
+SDL_AudioDeviceID Chip8AudioInit(Chip8System *Chip8) {
+    SDL_AudioSpec Want = {}, Have;
+    Want.freq = 48000;
+    Want.format = AUDIO_S16SYS;
+    Want.channels = 1;
+    Want.samples = 512; //About 11 ms, so the tone starts and stops within a frame
+    Want.callback = Chip8AudioCallback;
+    Want.userdata = Chip8->Shared;
+
+    SDL_AudioDeviceID Device = SDL_OpenAudioDevice(nullptr, 0, &Want, &Have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (Device == 0) {
+        std::cout << "Unable to open an audio device (" << SDL_GetError() << "), running without sound" << (Chip8->AudioSync ? " and timing frames with the system timer." : ".") << std::endl;
+        return 0;
+    }
+    //Phase is a 32 bit fraction of one period, so it wraps around by itself.
+    Chip8->Shared->SampleRate = Have.freq;
+    Chip8->Shared->ClockHz = Chip8->IPS == 0 ? 60 : Chip8->IPS;
+    Chip8->Shared->PhaseStep = (uint32_t)(((uint64_t)Chip8->ToneHz << 32) / Have.freq);
+    Chip8->Shared->Amplitude = (int16_t)(Chip8->Volume * 32767 / 100);
+    SDL_PauseAudioDevice(Device, 0);
+    return Device;
+}
+
 
 
 void Chip8Keyboard(Chip8System *Chip8) {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
         if (event.type == SDL_QUIT) {
-            exit(0);
+            Chip8->Shared->Running = false; //The emulation thread finishes its frame and main cleans up
         }
-        if (event.type == SDL_KEYDOWN) {
-            for (int i = 0; i < 16; i++) {
-                if (event.key.keysym.sym == Chip8->keymap[i]) {
-                    Chip8->Chip8KeyPad[i] = 1;
-                }
-            }
+        if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+            //The window was covered or resized and lost its contents, present the next frame even if it didn't change.
+            Chip8->Shared->ShownValid = false;
+        }
+        //Runs on the main thread, so keys only go into the shared mask, the emulation thread copies it into the keypad each frame.
+        //Keys are looked up by scancode, the key's position, so the keypad stays a 4x4 block on any keyboard layout.
+        if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == SDL_SCANCODE_F12) {
+            Chip8ReportLatency(Chip8->Shared);
+        }
+        //F1 to F9 load save state slots, with Shift they save them. The emulation thread owns the system, it does it before its next frame.
+        if (event.type == SDL_KEYDOWN && !event.key.repeat && event.key.keysym.scancode >= SDL_SCANCODE_F1 && event.key.keysym.scancode <= SDL_SCANCODE_F9) {
+            int Slot = event.key.keysym.scancode - SDL_SCANCODE_F1 + 1;
+            Chip8->Shared->StateRequest = (event.key.keysym.mod & KMOD_SHIFT) ? Slot : -Slot;
         }
-        if (event.type == SDL_KEYUP) {
-            for (int i = 0; i < 16; i++) {
-                if (event.key.keysym.sym == Chip8->keymap[i]) {
-                    Chip8->Chip8KeyPad[i] = 0;
+        if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && event.key.keysym.scancode < SDL_NUM_SCANCODES) {
+            int Key = Chip8->KeyLookup[event.key.keysym.scancode];
+            if (Key >= 0 && event.type == SDL_KEYDOWN) {
+                if (!event.key.repeat) {
+                    Chip8->Shared->KeyTime = Chip8Now(); //Start of the input latency measurement
                 }
+                Chip8->Shared->KeyMask |= 1 << Key;
+            }
+            if (Key >= 0 && event.type == SDL_KEYUP) {
+                Chip8->Shared->KeyMask &= ~(1 << Key);
             }
         }
     }
     return;
 }
 
+//Fills KeyLookup from keymap, called whenever keymap changes.
+void Chip8BuildKeyLookup(Chip8System *Chip8) {
+    for (int s = 0; s < SDL_NUM_SCANCODES; s++) {
+        Chip8->KeyLookup[s] = -1;
+    }
+    for (int k = 0; k < 16; k++) {
+        Chip8->KeyLookup[Chip8->keymap[k]] = k;
+    }
+}
 
-void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
+//Reads a keymap file, one key per line as the Chip-8 key in hex and the SDL name of the host key, e.g. "C 4" or "0 Keypad 0".
+//Lines starting with # are comments, keys the file leaves out keep their current mapping.
+//Returns false if the file can't be opened, and skips lines it can't read.
+bool Chip8LoadKeymap(Chip8System *Chip8, const std::string &Path) {
+    std::ifstream File(Path);
+    if (!File.is_open()) {
+        return false;
+    }
+    std::string Line;
+    while (std::getline(File, Line)) {
+        if (Line.empty() || Line[0] == '#' || Line.find(' ') == std::string::npos) {
+            continue;
+        }
+        std::string Name = Line.substr(Line.find(' ') + 1);
+        Name.erase(Name.find_last_not_of(" \r\t") + 1);
+        SDL_Scancode Scancode = SDL_GetScancodeFromName(Name.c_str());
+        if (Line.find(' ') != 1 || !isxdigit(Line[0]) || Scancode == SDL_SCANCODE_UNKNOWN) {
+            std::cout << "Skipping keymap line \"" << Line << "\"." << std::endl;
+            continue;
+        }
+        Chip8->keymap[(int)strtol(Line.substr(0, 1).c_str(), nullptr, 16)] = Scancode;
+    }
+    return true;
+}
+#endif
+
+
+#ifdef CHIP8_BENCHMARK
+void Chip8CPUSwitch(Chip8System *Chip8, uint16_t opcode) {
+    //Original nested switch decoder, kept for benchmarking against the table driven Chip8CPU.
+    //It doesn't follow the quirk profiles, it always shifts Vx in place, leaves I alone after Fx55/Fx65 and jumps to nnn + V0.
     switch (opcode & 0xF000) //Check the value of the first 4 bits
     {
         case 0x0000: 
             switch (opcode & 0x00FF)
             {
                 case 0x00E0: //Clear Screen
-                    for (int x = 0; x < 64; x++) {
-                        for (int y = 0; y < 32; y++) {
-                            Chip8->Chip8Display[x][y] = 0; //Set each pixel to off.
-                        }
+                    for (int y = 0; y < 32; y++) {
+                        Chip8->Chip8Display[y] = 0; //Set each pixel in the row to off.
                     }
+                    Chip8->DirtyRows = 0xFFFFFFFF;
+                    Chip8->DisplayUpdate = 1;
                     break;
 
                 case 0x00EE: //Return from Subtroutine 
@@ -369,7 +795,7 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
                     Chip8->V[(opcode & 0x0F00) >> 8] >>= 1;
                     break;
                 }
-                case 0x0007: //Sub Vy, Vx
+                case 0x0007: //Vx = Vy - Vx
                 {
                     if (Chip8->V[(opcode & 0x0F00) >> 8] < Chip8->V[(opcode & 0x00F0) >> 4]) {
                         Chip8->V[15] = 1;
@@ -377,12 +803,12 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
                     else {
                         Chip8->V[15] = 0;
                     }
-                    Chip8->V[(opcode & 0x00F0) >> 4] -= Chip8->V[(opcode & 0x0F00) >> 8];
+                    Chip8->V[(opcode & 0x0F00) >> 8] = Chip8->V[(opcode & 0x00F0) >> 4] - Chip8->V[(opcode & 0x0F00) >> 8];
                     break;
                 }
                 case 0x000E: //Shift Vx left  
                 {
-                    Chip8->V[15] = Chip8->V[(opcode & 0x0F00) >> 8] & 0x80;
+                    Chip8->V[15] = Chip8->V[(opcode & 0x0F00) >> 8] >> 7;
                     Chip8->V[(opcode & 0x0F00) >> 8] <<= 1;
                     break;
                 }
@@ -400,11 +826,11 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
             break;
 
         case 0xB000: //Jump to location nnn + V0
-            Chip8->PC = (opcode & 0x0FFF) + Chip8->V[0];
+            Chip8->PC = (opcode & 0x0FFF) + Chip8->V[0] - 2;
             break; 
 
         case 0xC000: //Load Vx with random number and kk
-            Chip8->V[(opcode & 0x0F00) >> 8] = (rand() % 256) & (opcode & 0x00FF);
+            Chip8->V[(opcode & 0x0F00) >> 8] = Chip8Random(Chip8) & (opcode & 0x00FF);
             break; 
 
         case 0xD000: //Draw sprite 
@@ -425,19 +851,26 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
             //Drawing Loops
             for (int ylen = 0; ylen < spriteheight; ylen++) {
 
-                spritepixel = Chip8->Chip8Memory[Chip8->I + ylen]; //The current pixel being drawn, given to us from the I value and the sprite height.
+                spritepixel = Chip8->Chip8Memory[(Chip8->I + ylen) & 0xFFF]; //The current pixel being drawn, given to us from the I value and the sprite height.
     
                 for (int xlen = 0; xlen < 8; xlen++) { //X val is preset always to 8, since the sprite is 8 pixels wide.
                     
+                    //Sprites that go past the edge of the screen are clipped.
+                    if (Spritex + xlen >= 64 || Spritey + ylen >= 32) {
+                        continue;
+                    }
+
                     //Check if the sprite data has this pixel set to 1
                     if ((spritepixel & (0x80 >> xlen)) != 0) {
-                        
-                        if (Chip8->Chip8Display[(Spritex + xlen)][(Spritey + ylen)] == 1) { 
+                        uint64_t Pixel = 1ull << (63 - (Spritex + xlen)); //Bit 63 of a row is the leftmost pixel
+
+                        if (Chip8->Chip8Display[Spritey + ylen] & Pixel) { 
                             //If there is a colision, where a pixel is alreay on, set it to zero and set the colision flag to 1.
                             Chip8->V[15] = 1; //Set colision value equal to 1
                         }
 
-                        Chip8->Chip8Display[(Spritex + xlen)][(Spritey + ylen)] ^= 1; //Exclusive OR the pixel
+                        Chip8->Chip8Display[Spritey + ylen] ^= Pixel; //Exclusive OR the pixel
+                        Chip8->DirtyRows |= 1u << (Spritey + ylen);
                     }
                 }
             }
@@ -451,14 +884,15 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
             switch (opcode & 0x00FF)
             {
                 case 0x009E: //Skip instruction if key is pressed
-                
-                    if (Chip8->Chip8KeyPad[Chip8->V[(opcode & 0x0F00) >> 8]] != 0) {
+                    Chip8->KeyPolled = 1;
+                    if ((Chip8->Chip8KeyPad >> (Chip8->V[(opcode & 0x0F00) >> 8] & 0xF)) & 1) {
                         Chip8->PC += 2;
                     }
                     break;
 
                 case 0x00A1: //Skip instruction if key is not pressed
-                    if (Chip8->Chip8KeyPad[Chip8->V[(opcode & 0x0F00) >> 8]] == 0) {
+                    Chip8->KeyPolled = 1;
+                    if (((Chip8->Chip8KeyPad >> (Chip8->V[(opcode & 0x0F00) >> 8] & 0xF)) & 1) == 0) {
                         Chip8->PC += 2;
                     }
                     break;
@@ -469,15 +903,16 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
             switch (opcode & 0x00FF) 
             {
                 case 0x0007: //Set Vx to Delay Timer
-                    Chip8->V[(opcode & 0x0F00) >> 8] = Chip8->DelayTimer;
+                    Chip8->V[(opcode & 0x0F00) >> 8] = Chip8DelayTimer(Chip8);
                     break;
                 
                 case 0x000A: //Wait for keypress then store in Vx 
                 {
+                    Chip8->KeyPolled = 1;
                     for (int i = 0; i < 16; i++) {
-                        if (Chip8->Chip8KeyPad[i] != 0) {
+                        if ((Chip8->Chip8KeyPad >> i) & 1) {
                             Chip8->V[(opcode & 0x0F00) >> 8] = i;
-                            break;
+                            return;
                         }
                     }
 
@@ -486,32 +921,32 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
                     return;
                 }
                 case 0x0015: //Set delay timer to Vx
-                    Chip8->DelayTimer = Chip8->V[(opcode & 0x0F00) >> 8];
+                    Chip8SetDelayTimer(Chip8, Chip8->V[(opcode & 0x0F00) >> 8]);
                     break;
                 
                 case 0x0018: //Set sound timer to Vc
-                    Chip8->SoundTimer = Chip8->V[(opcode & 0x0F00) >> 8];
+                    Chip8->SoundExpiry = Chip8->Ticks + Chip8->V[(opcode & 0x0F00) >> 8];
                     break;
                 
                 case 0x001E: //Set I equal to I + Vx
-                    Chip8->I += Chip8->V[(opcode & 0x0F00) >> 8];
+                    Chip8->I = (Chip8->I + Chip8->V[(opcode & 0x0F00) >> 8]) & 0xFFF;
                     break;
                 
                 case 0x0029: //Set I equal to location of the sprite for Digit at Vx
-                    Chip8->I = Chip8->V[(opcode & 0x0F00) >> 8] * 5; 
+                    Chip8->I = 0x50 + (Chip8->V[(opcode & 0x0F00) >> 8] & 0xF) * 5; //The font starts at 0x50, 5 bytes per digit
                     break;
                 
                 case 0x0033: //Store the decimal representation of Vx in memory locations I, I+1, and I+2
                     Chip8->Chip8Memory[Chip8->I] = Chip8->V[(opcode & 0x0F00) >> 8] / 100;
-                    Chip8->Chip8Memory[Chip8->I + 1] = (Chip8->V[(opcode & 0x0F00) >> 8] / 10) % 10;
-                    Chip8->Chip8Memory[Chip8->I + 2] = Chip8->V[(opcode & 0x0F00) >> 8] % 10;
+                    Chip8->Chip8Memory[(Chip8->I + 1) & 0xFFF] = (Chip8->V[(opcode & 0x0F00) >> 8] / 10) % 10;
+                    Chip8->Chip8Memory[(Chip8->I + 2) & 0xFFF] = Chip8->V[(opcode & 0x0F00) >> 8] % 10;
                     break;
                 
                 case 0x0055: //Store V0 to Vx in memory at location I and up 
                 {
                     uint8_t numRegStore = (opcode & 0x0F00) >> 8;
                     for (int i = 0; i <= numRegStore; i++) {
-                        Chip8->Chip8Memory[Chip8->I + i] = Chip8->V[i];
+                        Chip8->Chip8Memory[(Chip8->I + i) & 0xFFF] = Chip8->V[i];
                     }
                     break;
                 }
@@ -519,7 +954,7 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
                 {
                     uint8_t numRegLoad = (opcode & 0x0F00) >> 8;
                     for (int i = 0; i <= numRegLoad; i++) {
-                        Chip8->V[i] = Chip8->Chip8Memory[Chip8->I + i];
+                        Chip8->V[i] = Chip8->Chip8Memory[(Chip8->I + i) & 0xFFF];
                     }
                     break;
                 }
@@ -527,4 +962,2038 @@ void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
         break; 
     }
     return;
-}
\ No newline at end of file
+}
+#endif
+
+#ifndef CHIP8_HEADLESS
+//Emulation thread, one iteration per 60 hz frame until the main thread clears Running.
+int Chip8EmulationThread(void *Data) {
+    Chip8System *Chip8 = (Chip8System *)Data;
+
+    //Frame timing, the scheduler runs at 60 hz no matter how many instructions each frame executes.
+    //With AudioSync the audio device's clock sets that rate, and the system timer only bounds batches at unlimited speed.
+    uint64_t NextFrame = Chip8Now() + CHIP8_FRAME_NS;
+    bool AudioSync = Chip8->AudioSync && Chip8->Shared->SampleRate != 0;
+    uint64_t AudioFrames = 0;
+
+    while (Chip8->Shared->Running) {
+        if (AudioSync) {
+            NextFrame = Chip8Now() + CHIP8_FRAME_NS;
+        }
+
+        //Save states asked for with the F keys, between frames where nothing is half done.
+        int Request = Chip8->Shared->StateRequest.exchange(0);
+        if (Request != 0) {
+            Chip8StateSlot(Chip8, Request > 0 ? Request : -Request, Request > 0);
+        }
+
+        //Pick up the keys once per frame
+        uint16_t Keys = Chip8->Shared->KeyMask;
+        if (Keys & ~Chip8->Chip8KeyPad) {
+            //A key went down, follow it until the frame showing what it did is presented.
+            Chip8->Probe = {Chip8->Shared->KeyTime, 0, 0};
+            Chip8->KeyPolled = 0;
+        }
+        Chip8->Chip8KeyPad = Keys;
+
+        //Run this frame's share of instructions, or batches until the frame time is used up at unlimited speed.
+        //Draws and the sound starting only pause Chip8Run, a ROM waiting on a key or sitting in an idle loop ends the frame's work,
+        //and the thread sleeps out the frame below instead of spinning.
+        Chip8->CycleBudget += Chip8->IPS;
+        int FrameCycles = Chip8->CycleBudget / 60;
+        Chip8->CycleBudget %= 60;
+        int Budget = FrameCycles;
+        int Reason = CHIP8_EXIT_BUDGET;
+
+        while (Chip8->IPS == 0 ? Chip8Now() < NextFrame : FrameCycles > 0) {
+            int Slice = Chip8->IPS == 0 ? 1000 : FrameCycles;
+            if (Chip8->MaxCycles != 0 && Chip8->MaxCycles - Chip8->Cycles < (uint64_t)Slice) {
+                Slice = (int)(Chip8->MaxCycles - Chip8->Cycles); //Stop on the exact instruction asked for
+            }
+            if (Slice == 0) {
+                break;
+            }
+            Reason = Chip8Run(Chip8, Slice);
+            FrameCycles -= Chip8->CyclesRun;
+            Chip8->Cycles += Chip8->CyclesRun;
+            if (Chip8->Probe.Key != 0) {
+                Chip8TrackLatency(Chip8, Reason);
+            }
+            if (Reason == CHIP8_EXIT_SOUND) {
+                //Fx18 turned the tone on or off, stamp it with the cycle it ran on so it lands on the right sample
+                Chip8PushAudioEvent(Chip8->Shared, Chip8->AudioClock + Budget - (FrameCycles > 0 ? FrameCycles : 0), Chip8SoundTimer(Chip8) > 0);
+            }
+            if (Reason == CHIP8_EXIT_IDLE || Reason == CHIP8_EXIT_KEYWAIT || Reason == CHIP8_EXIT_BREAKPOINT) {
+                break;
+            }
+        }
+
+        //Hand the frame over at most once per frame, and only if it changed since the last one.
+        //Draws only mark rows dirty, a sprite erased and drawn again in the same frame isn't published.
+        if (Chip8->DisplayUpdate && Chip8ChangedRows(Chip8) != 0) {
+            Chip8PublishFrame(Chip8->Shared, Chip8->Chip8Display, &Chip8->Probe);
+        }
+
+        //The audio clock moves a whole frame's budget every frame, even when the ROM idled through part of it, so it keeps pace with real time.
+        //At unlimited speed it counts frames instead, and the tone changes on frame edges.
+        Chip8->AudioClock += Chip8->IPS == 0 ? 1 : Budget;
+
+        //Timers always tick at 60 hz, independent of the CPU speed.
+        Chip8UpdateTimers(Chip8);
+        Chip8->Shared->AudioClock.store(Chip8->AudioClock, std::memory_order_release);
+        Chip8->Frames++;
+
+        const char *Stop = Chip8StopCondition(Chip8, Reason);
+        if (Stop != nullptr) {
+            std::cout << "Stopped, " << Stop << ", after " << Chip8->Frames << " frames and " << Chip8->Cycles << " instructions at PC " << std::hex << Chip8->PC << std::dec << "." << std::endl;
+            Chip8->Shared->Running = false;
+            break;
+        }
+
+        if (AudioSync) {
+            Chip8WaitAudio(Chip8->Shared, &AudioFrames);
+        }
+        else {
+            Chip8WaitFrame(&NextFrame, &Chip8->Shared->Pacing);
+        }
+    }
+    return 0;
+}
+#endif
+
+//Checks the exit conditions given on the command line after a frame, Reason being how its last Chip8Run ended.
+//Returns why the emulator should stop, nullptr to keep going.
+const char *Chip8StopCondition(const Chip8System *Chip8, int Reason) {
+    if (Chip8->MaxFrames != 0 && Chip8->Frames >= Chip8->MaxFrames) {
+        return "frame limit reached";
+    }
+    if (Chip8->MaxCycles != 0 && Chip8->Cycles >= Chip8->MaxCycles) {
+        return "instruction limit reached";
+    }
+    if (Chip8->ExitOnHalt && Chip8->Idle == CHIP8_IDLE_HALT) {
+        return "ROM halted";
+    }
+    if (Chip8->ExitOnKeyWait && Reason == CHIP8_EXIT_KEYWAIT) {
+        return "ROM waiting for a key";
+    }
+    if (Reason == CHIP8_EXIT_BREAKPOINT) {
+        return "breakpoint reached";
+    }
+    return nullptr;
+}
+
+//Headless Mode
+//Runs the ROM with no window, sound, input or pacing, as fast as the host allows, then prints the final state.
+//Guest time still moves in 60 hz frames of IPS / 60 instructions (1000 when IPS is 0), so the result matches a windowed run of the same length.
+//Idle delay loops are skipped with Chip8FastForward, and since no key can ever be pressed a halt or an Fx0A wait ends the run.
+//So does a delay loop waiting for a value the timer has already counted past, unless there is a frame limit to skip to.
+int Chip8RunHeadless(Chip8System *Chip8) {
+    const char *Stop = nullptr;
+    uint64_t SoundFrames = 0; //Frames the tone would have played for
+    uint64_t Begin = Chip8Now();
+
+    while (Stop == nullptr) {
+        Chip8->CycleBudget += Chip8->IPS == 0 ? 60000 : Chip8->IPS;
+        int FrameCycles = Chip8->CycleBudget / 60;
+        Chip8->CycleBudget %= 60;
+        int Reason = CHIP8_EXIT_BUDGET;
+
+        while (FrameCycles > 0) {
+            int Slice = FrameCycles;
+            if (Chip8->MaxCycles != 0 && Chip8->MaxCycles - Chip8->Cycles < (uint64_t)Slice) {
+                Slice = (int)(Chip8->MaxCycles - Chip8->Cycles);
+            }
+            if (Slice == 0) {
+                break;
+            }
+            Reason = Chip8Run(Chip8, Slice);
+            FrameCycles -= Chip8->CyclesRun;
+            Chip8->Cycles += Chip8->CyclesRun;
+            if (Reason == CHIP8_EXIT_IDLE || Reason == CHIP8_EXIT_KEYWAIT || Reason == CHIP8_EXIT_BREAKPOINT) {
+                break;
+            }
+        }
+
+        SoundFrames += Chip8SoundTimer(Chip8) > 0;
+        Chip8UpdateTimers(Chip8);
+        Chip8->Frames++;
+
+        Stop = Chip8StopCondition(Chip8, Reason);
+        if (Stop == nullptr && Chip8->Idle == CHIP8_IDLE_HALT) {
+            Stop = "ROM halted";
+        }
+        if (Stop == nullptr && Chip8->Idle == CHIP8_IDLE_KEY) {
+            Stop = "ROM waiting for a key, there is no input in headless mode";
+        }
+        if (Stop == nullptr && Chip8->Idle == CHIP8_IDLE_DELAY && Chip8->MaxFrames == 0 && Chip8DelayTimer(Chip8) < Chip8DelayPoll(Chip8)) {
+            Stop = "ROM waiting on a delay value that never arrives";
+        }
+        if (Stop == nullptr && Chip8->Idle == CHIP8_IDLE_DELAY) {
+            //Nothing but the delay timer moves until the loop ends, skip straight to that frame.
+            uint64_t Left = Chip8->MaxFrames != 0 ? Chip8->MaxFrames - Chip8->Frames : INT32_MAX;
+            uint8_t Sound = Chip8SoundTimer(Chip8);
+            int Skipped = Chip8FastForward(Chip8, Left < INT32_MAX ? (int)Left : INT32_MAX);
+            SoundFrames += Skipped < Sound ? Skipped : Sound;
+            Chip8->Frames += Skipped;
+            Stop = Chip8StopCondition(Chip8, CHIP8_EXIT_BUDGET);
+            if (Stop == nullptr && Skipped == 0) {
+                Stop = "ROM waiting on a delay value that never arrives";
+            }
+        }
+    }
+    double Seconds = (Chip8Now() - Begin) / 1e9;
+    if (Chip8->Resume) {
+        Chip8StateSlot(Chip8, 0, true);
+    }
+
+    std::cout << "Stopped, " << Stop << ", after " << Chip8->Frames << " frames and " << Chip8->Cycles << " instructions." << std::endl;
+    std::cout << std::hex << std::uppercase << std::setfill('0');
+    std::cout << "PC " << std::setw(3) << Chip8->PC << "  I " << std::setw(3) << Chip8->I << "  SP " << std::setw(1) << Chip8->SP
+        << "  DT " << std::setw(2) << (int)Chip8DelayTimer(Chip8) << "  ST " << std::setw(2) << (int)Chip8SoundTimer(Chip8) << std::endl;
+    for (int r = 0; r < 16; r++) {
+        std::cout << "V" << r << " " << std::setw(2) << (int)Chip8->V[r] << (r % 8 == 7 ? "\n" : "  ");
+    }
+    std::cout << "Display hash " << std::setw(16) << Chip8DisplayHash(Chip8) << std::endl;
+    std::cout << std::dec << std::nouppercase << std::setfill(' ');
+    std::cout << "Sound on for " << SoundFrames << " frames" << std::endl;
+    std::cout << "Ran in " << Seconds * 1000.0 << " ms, " << (Seconds > 0 ? Chip8->Cycles / Seconds / 1000000.0 : 0.0) << " million instructions per second" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+//FNV-1a hash of the framebuffer, row by row from the top and each row from its leftmost pixel, so it is the same on every host.
+uint64_t Chip8DisplayHash(const Chip8System *Chip8) {
+    uint64_t Hash = 0xCBF29CE484222325;
+    for (int y = 0; y < 32; y++) {
+        for (int b = 56; b >= 0; b -= 8) {
+            Hash = (Hash ^ (uint8_t)(Chip8->Chip8Display[y] >> b)) * 0x100000001B3;
+        }
+    }
+    return Hash;
+}
+
+//Platform
+//The clock and sleeping are the only OS specific parts of the emulator outside of SDL and the JIT's code memory.
+//Monotonic time in nanoseconds, the same clock clock_nanosleep waits on.
+uint64_t Chip8Now() {
+#ifdef _WIN32
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (uint64_t)Time.tv_sec * 1000000000 + Time.tv_nsec;
+#endif
+}
+
+//Sleeps until Deadline (from Chip8Now). The OS timer can wake a millisecond or more late,
+//so with Spin it only sleeps until CHIP8_SPIN_NS before the deadline and spins out the rest, which lands within a few microseconds.
+void Chip8SleepUntil(uint64_t Deadline, bool Spin) {
+    uint64_t Wake = Spin ? Deadline - CHIP8_SPIN_NS : Deadline;
+    uint64_t Now = Chip8Now();
+    if (Wake > Now && Wake <= Deadline) {
+#ifdef _WIN32
+        Sleep((DWORD)((Wake - Now) / 1000000));
+#else
+        timespec Time = {(time_t)(Wake / 1000000000), (long)(Wake % 1000000000)};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Time, nullptr) == EINTR) {
+        }
+#endif
+    }
+    while (Spin && Chip8Now() < Deadline) {
+    }
+}
+
+#ifndef CHIP8_HEADLESS
+//Sleeps for the rest of the frame and moves NextFrame on to the next one.
+//The emulation thread passes its Pacing stats, its frames start on time to within microseconds and how late each one started is recorded.
+//The main thread passes nullptr, it only polls events and presents, so it sleeps without spinning and doesn't compete with the emulation thread for the CPU.
+void Chip8WaitFrame(uint64_t *NextFrame, Chip8PaceStats *Pacing) {
+    uint64_t Now = Chip8Now();
+    if (Now < *NextFrame) {
+        Chip8SleepUntil(*NextFrame, Pacing != nullptr);
+        Now = Chip8Now();
+    }
+    if (Pacing != nullptr) {
+        Pacing->Late[Pacing->Count % CHIP8_PACE_SAMPLES] = (float)((Now - *NextFrame) / 1e6);
+        Pacing->Count++;
+    }
+    if (Now < *NextFrame + CHIP8_FRAME_NS) {
+        *NextFrame += CHIP8_FRAME_NS;
+    }
+    else {
+        //We fell a whole frame behind (slow host or window drag), start counting again from now instead of rushing to catch up.
+        *NextFrame = Now + CHIP8_FRAME_NS;
+    }
+}
+
+//Audio clock pacing, counts one more frame done and waits until the audio device has played far enough for the next one.
+//The emulator stays CHIP8_AUDIO_LAG frames ahead of what the device has played, which is where the audio callback expects it,
+//so the two share one clock and can't drift apart however long the session runs.
+void Chip8WaitAudio(Chip8Shared *Shared, uint64_t *Frames) {
+    (*Frames)++;
+    while (Shared->Running) {
+        uint64_t Played = Shared->SamplesPlayed.load(std::memory_order_acquire);
+        uint64_t Due = Played * 60 / Shared->SampleRate + CHIP8_AUDIO_LAG; //Frames that should be done by now
+        if (*Frames < Due) {
+            if (Due - *Frames > CHIP8_AUDIO_MAX_BEHIND) {
+                //Too far behind to catch up in a burst (slow host or the device restarted), drop the missed frames, the audio callback re-syncs.
+                *Frames = Due - 1;
+            }
+            return;
+        }
+        //Sleep until the device has played the samples the next frame waits on.
+        uint64_t Needed = ((*Frames - CHIP8_AUDIO_LAG + 1) * Shared->SampleRate + 59) / 60;
+        uint64_t Wait = (Needed - Played) * 1000000000 / Shared->SampleRate;
+        Chip8SleepUntil(Chip8Now() + (Wait > 1000000 ? Wait : 1000000), false);
+    }
+}
+
+//Input latency, one key press is followed at a time through four timestamps:
+//the key event on the main thread, the first slice where the ROM read the keypad after it (Ex9E, ExA1 or Fx0A),
+//the first draw after that, and the present that puts that frame on screen.
+//Moves the probe on after each slice on the emulation thread.
+void Chip8TrackLatency(Chip8System *Chip8, int Reason) {
+    if (Chip8->Probe.Poll == 0 && Chip8->KeyPolled) {
+        Chip8->Probe.Poll = Chip8Now();
+    }
+    //Draws end slices, so a slice that read the keys and drew did it in that order.
+    if (Chip8->Probe.Poll != 0 && Chip8->Probe.Draw == 0 && Reason == CHIP8_EXIT_DRAW) {
+        Chip8->Probe.Draw = Chip8Now();
+    }
+}
+
+//Adds a finished probe to the stats, on the main thread right after the present.
+void Chip8RecordLatency(Chip8Shared *Shared, Chip8LatencyProbe *Probe, uint64_t Presented) {
+    if (Probe->Key == 0) {
+        return;
+    }
+    Chip8LatencyStats *Stats = &Shared->Latency;
+    double Ms = 1e-6;
+    int Slot = Stats->Count % CHIP8_LATENCY_SAMPLES;
+    Stats->Poll[Slot] = (float)((Probe->Poll - Probe->Key) * Ms);
+    Stats->Draw[Slot] = (float)((Probe->Draw - Probe->Key) * Ms);
+    Stats->Present[Slot] = (float)((Presented - Probe->Key) * Ms);
+    Stats->Count++;
+    *Probe = {};
+}
+
+static float Chip8Percentile(std::vector<float> &Sorted, int Percent) {
+    return Sorted[(Sorted.size() - 1) * Percent / 100];
+}
+
+//Prints p50/p95/p99 for each stage over the last CHIP8_LATENCY_SAMPLES key presses, on F12 and when the emulator exits.
+void Chip8ReportLatency(const Chip8Shared *Shared) {
+    const Chip8LatencyStats *Stats = &Shared->Latency;
+    int Count = Stats->Count < CHIP8_LATENCY_SAMPLES ? Stats->Count : CHIP8_LATENCY_SAMPLES;
+    if (Count == 0) {
+        std::cout << "No input latency measured yet, press a key the ROM reacts to." << std::endl;
+        return;
+    }
+    std::cout << "Input latency over the last " << Count << " key presses, p50 / p95 / p99 in ms:" << std::endl;
+    const char *Names[3] = {"Key to keypad read", "Key to draw", "Key to present"};
+    const float *Stages[3] = {Stats->Poll, Stats->Draw, Stats->Present};
+    for (int s = 0; s < 3; s++) {
+        std::vector<float> Sorted(Stages[s], Stages[s] + Count);
+        std::sort(Sorted.begin(), Sorted.end());
+        std::cout << "  " << Names[s] << ": " << Chip8Percentile(Sorted, 50) << " / " << Chip8Percentile(Sorted, 95) << " / " << Chip8Percentile(Sorted, 99) << std::endl;
+    }
+}
+
+//Writes how late each of the last CHIP8_PACE_SAMPLES frames started to Path as CSV and prints a summary, once the emulation thread has stopped.
+void Chip8ReportPacing(const Chip8Shared *Shared, const char *Path) {
+    const Chip8PaceStats *Pacing = &Shared->Pacing;
+    uint64_t Count = Pacing->Count < CHIP8_PACE_SAMPLES ? Pacing->Count : CHIP8_PACE_SAMPLES;
+    if (Count == 0) {
+        return;
+    }
+    std::ofstream File(Path);
+    if (!File.is_open()) {
+        std::cout << "Unable to write " << Path << "." << std::endl;
+        return;
+    }
+    File << "frame,late_ms" << std::endl;
+    std::vector<float> Sorted;
+    for (uint64_t f = Pacing->Count - Count; f < Pacing->Count; f++) {
+        float Late = Pacing->Late[f % CHIP8_PACE_SAMPLES];
+        File << f << "," << Late << std::endl;
+        Sorted.push_back(Late);
+    }
+    std::sort(Sorted.begin(), Sorted.end());
+    std::cout << "Frame pacing over the last " << Count << " frames, late by p50 / p99 / max in ms: "
+        << Chip8Percentile(Sorted, 50) << " / " << Chip8Percentile(Sorted, 99) << " / " << Sorted.back() << ", written to " << Path << "." << std::endl;
+}
+#endif
+
+//Triple buffered frame handoff. The emulation thread fills its back buffer and swaps it with Latest,
+//the main thread swaps its front buffer with Latest when a fresh frame is waiting.
+//Neither side ever waits, and a frame is never torn since each buffer has only one owner at a time.
+//A probe that has reached its draw travels with the frame and is cleared, the main thread finishes it when the frame is presented.
+void Chip8PublishFrame(Chip8Shared *Shared, const uint64_t *Display, Chip8LatencyProbe *Probe) {
+    memcpy(Shared->Frames[Shared->Back], Display, sizeof(Shared->Frames[0]));
+    Shared->FrameProbes[Shared->Back] = {};
+    if (Probe->Draw != 0) {
+        Shared->FrameProbes[Shared->Back] = *Probe;
+        *Probe = {};
+    }
+    Shared->Back = Shared->Latest.exchange(Shared->Back | CHIP8_FRAME_FRESH) & 3;
+}
+
+//Returns true and moves Front to the newest frame if one was published since the last call.
+bool Chip8TakeFrame(Chip8Shared *Shared) {
+    if ((Shared->Latest.load(std::memory_order_relaxed) & CHIP8_FRAME_FRESH) == 0) {
+        return false;
+    }
+    Shared->Front = Shared->Latest.exchange(Shared->Front) & 3;
+    return true;
+}
+
+//Display helpers shared by every CPU core.
+void Chip8ClearDisplay(Chip8System *Chip8) {
+    for (int y = 0; y < 32; y++) {
+        Chip8->DirtyRows |= (uint32_t)(Chip8->Chip8Display[y] != 0) << y; //Rows that were already blank didn't change
+    }
+    memset(Chip8->Chip8Display, 0, sizeof(Chip8->Chip8Display));
+    Chip8->DisplayUpdate = 1;
+    Chip8->ExitReason = CHIP8_EXIT_DRAW;
+}
+
+//XORs a sprite of Height rows, read from Address, onto the display and returns the colision flag for VF.
+//Parts of the sprite past the right or bottom edge are clipped, or drawn on the other side of the screen with Wrap set.
+//Each display row is one uint64_t with the leftmost pixel in bit 63, so a sprite row is placed with one shift,
+//tested for colision with one AND and drawn with one XOR.
+template <bool Wrap>
+static inline uint8_t Chip8DrawSpriteRows(Chip8System *Chip8, uint8_t Spritex, uint8_t Spritey, uint16_t Address, uint8_t Height) {
+    uint64_t Colision = 0;
+    Spritex %= 64;
+    Spritey %= 32;
+
+    for (int ylen = 0; ylen < Height && (Wrap || Spritey + ylen < 32); ylen++) {
+        uint64_t Sprite = (uint64_t)Chip8->Chip8Memory[(Address + ylen) & 0xFFF] << 56;
+        uint64_t Bits = Sprite >> Spritex; //Columns past the right edge fall off the end
+        if (Wrap && Spritex > 56) {
+            Bits |= Sprite << (64 - Spritex); //and come back in on the left
+        }
+
+        uint64_t *Row = &Chip8->Chip8Display[(Spritey + ylen) % 32];
+        Colision |= *Row & Bits;
+        *Row ^= Bits;
+        Chip8->DirtyRows |= (uint32_t)(Bits != 0) << ((Spritey + ylen) % 32); //Blank sprite rows leave the display alone
+    }
+    Chip8->DisplayUpdate = 1;
+    Chip8->ExitReason = CHIP8_EXIT_DRAW;
+    return Colision != 0;
+}
+
+uint8_t Chip8DrawSprite(Chip8System *Chip8, uint8_t Spritex, uint8_t Spritey, uint16_t Address, uint8_t Height, bool Wrap) {
+    if (Wrap) {
+        return Chip8DrawSpriteRows<true>(Chip8, Spritex, Spritey, Address, Height);
+    }
+    return Chip8DrawSpriteRows<false>(Chip8, Spritex, Spritey, Address, Height);
+}
+
+//Sets the sound timer for Fx18, starting the tone is an event that ends Chip8Run.
+void Chip8SetSoundTimer(Chip8System *Chip8, uint8_t Value) {
+    if ((Chip8SoundTimer(Chip8) == 0) != (Value == 0)) {
+        Chip8->ExitReason = CHIP8_EXIT_SOUND;
+    }
+    Chip8->SoundExpiry = Chip8->Ticks + Value;
+}
+
+static void Chip8OpDecodeMiss(Chip8System *Chip8, uint16_t Opcode);
+static void Chip8InvalidateBlocks(Chip8System *Chip8, uint16_t Address, int Length);
+
+//Called for every guest write to memory, marks the cached instructions and blocks covering those bytes as stale so self modifying ROMs stay correct.
+void Chip8InvalidateCode(Chip8System *Chip8, uint16_t Address, int Length) {
+    if (Address + Length > 4096) { //Writes through I wrap around to the start of memory
+        Chip8InvalidateCode(Chip8, 0, Address + Length - 4096);
+        Length = 4096 - Address;
+    }
+    bool HitsBlock = false;
+    for (int a = Address & ~1; a < Address + Length; a += 2) {
+        Chip8->DecodeCache[(a >> 1) & 0x7FF].Handler = Chip8OpDecodeMiss;
+        HitsBlock |= Chip8->CodeMap[a & 0xFFF] | Chip8->CodeMap[(a + 1) & 0xFFF];
+    }
+    if (HitsBlock) {
+        Chip8InvalidateBlocks(Chip8, Address, Length);
+    }
+}
+
+//Operand fields of an opcode.
+static inline uint8_t Chip8X(uint16_t Opcode) { return (Opcode & 0x0F00) >> 8; }
+static inline uint8_t Chip8Y(uint16_t Opcode) { return (Opcode & 0x00F0) >> 4; }
+static inline uint8_t Chip8N(uint16_t Opcode) { return Opcode & 0x000F; }
+static inline uint8_t Chip8KK(uint16_t Opcode) { return Opcode & 0x00FF; }
+static inline uint16_t Chip8NNN(uint16_t Opcode) { return Opcode & 0x0FFF; }
+
+//Table Driven Opcode Handlers
+//Each handler executes exactly one kind of opcode, so the decoder only has to do one table lookup instead of walking through nested switches.
+//Handlers get the raw opcode and pull out only the operand fields they use, a mask and a shift each, instead of every field being filled in before each call.
+//Handlers for opcodes the quirk profiles disagree on are templates, with one instance and one handler table per profile.
+
+static void Chip8OpNop(Chip8System *, uint16_t) { //Unknown opcodes and 0nnn (SYS addr) are ignored
+    return;
+}
+
+static void Chip8Op00E0(Chip8System *Chip8, uint16_t) { //Clear Screen
+    Chip8ClearDisplay(Chip8);
+}
+
+static void Chip8Op00EE(Chip8System *Chip8, uint16_t) { //Return from Subroutine
+    Chip8->PC = Chip8->Stack[Chip8->SP];
+    Chip8->SP++;
+}
+
+static void Chip8Op1nnn(Chip8System *Chip8, uint16_t Opcode) { //Jump
+    Chip8->PC = Chip8NNN(Opcode) - 2; //Since our system increments PC anyways, we need to subtract by two.
+}
+
+static void Chip8Op2nnn(Chip8System *Chip8, uint16_t Opcode) { //Call subroutine
+    Chip8->SP--;
+    Chip8->Stack[Chip8->SP] = Chip8->PC;
+    Chip8->PC = Chip8NNN(Opcode) - 2;
+}
+
+static void Chip8Op3xkk(Chip8System *Chip8, uint16_t Opcode) { //Skip next instruction if Vx == kk
+    if (Chip8->V[Chip8X(Opcode)] == Chip8KK(Opcode)) {
+        Chip8->PC += 2;
+    }
+}
+
+static void Chip8Op4xkk(Chip8System *Chip8, uint16_t Opcode) { //Skip next instruction if Vx != kk
+    if (Chip8->V[Chip8X(Opcode)] != Chip8KK(Opcode)) {
+        Chip8->PC += 2;
+    }
+}
+
+static void Chip8Op5xy0(Chip8System *Chip8, uint16_t Opcode) { //Skip next instruction if Vx == Vy
+    if (Chip8->V[Chip8X(Opcode)] == Chip8->V[Chip8Y(Opcode)]) {
+        Chip8->PC += 2;
+    }
+}
+
+static void Chip8Op6xkk(Chip8System *Chip8, uint16_t Opcode) { //Load Vx with kk
+    Chip8->V[Chip8X(Opcode)] = Chip8KK(Opcode);
+}
+
+static void Chip8Op7xkk(Chip8System *Chip8, uint16_t Opcode) { //Add kk to Vx
+    Chip8->V[Chip8X(Opcode)] += Chip8KK(Opcode);
+}
+
+static void Chip8Op8xy0(Chip8System *Chip8, uint16_t Opcode) { //LD Vx, Vy
+    Chip8->V[Chip8X(Opcode)] = Chip8->V[Chip8Y(Opcode)];
+}
+
+template <int Profile>
+static void Chip8Op8xy1(Chip8System *Chip8, uint16_t Opcode) { //OR Vx, Vy
+    Chip8->V[Chip8X(Opcode)] |= Chip8->V[Chip8Y(Opcode)];
+    if constexpr (Chip8QuirkProfiles[Profile].ResetVF) {
+        Chip8->V[15] = 0;
+    }
+}
+
+template <int Profile>
+static void Chip8Op8xy2(Chip8System *Chip8, uint16_t Opcode) { //AND Vx, Vy
+    Chip8->V[Chip8X(Opcode)] &= Chip8->V[Chip8Y(Opcode)];
+    if constexpr (Chip8QuirkProfiles[Profile].ResetVF) {
+        Chip8->V[15] = 0;
+    }
+}
+
+template <int Profile>
+static void Chip8Op8xy3(Chip8System *Chip8, uint16_t Opcode) { //XOR Vx, Vy
+    Chip8->V[Chip8X(Opcode)] ^= Chip8->V[Chip8Y(Opcode)];
+    if constexpr (Chip8QuirkProfiles[Profile].ResetVF) {
+        Chip8->V[15] = 0;
+    }
+}
+
+static void Chip8Op8xy4(Chip8System *Chip8, uint16_t Opcode) { //ADD Vx, Vy
+    uint16_t Sum = Chip8->V[Chip8X(Opcode)] + Chip8->V[Chip8Y(Opcode)];
+    Chip8->V[15] = Sum > 255;
+    Chip8->V[Chip8X(Opcode)] = (uint8_t)Sum; //Written after VF, the same order as the switch core.
+}
+
+static void Chip8Op8xy5(Chip8System *Chip8, uint16_t Opcode) { //SUB Vx, Vy
+    Chip8->V[15] = Chip8->V[Chip8X(Opcode)] > Chip8->V[Chip8Y(Opcode)];
+    Chip8->V[Chip8X(Opcode)] -= Chip8->V[Chip8Y(Opcode)];
+}
+
+template <int Profile>
+static void Chip8Op8xy6(Chip8System *Chip8, uint16_t Opcode) { //Shift right, Vx or Vy depending on the profile
+    constexpr bool ShiftVy = Chip8QuirkProfiles[Profile].ShiftVy;
+    Chip8->V[15] = Chip8->V[ShiftVy ? Chip8Y(Opcode) : Chip8X(Opcode)] & 0x1;
+    Chip8->V[Chip8X(Opcode)] = Chip8->V[ShiftVy ? Chip8Y(Opcode) : Chip8X(Opcode)] >> 1;
+}
+
+static void Chip8Op8xy7(Chip8System *Chip8, uint16_t Opcode) { //SUBN, Vx = Vy - Vx
+    Chip8->V[15] = Chip8->V[Chip8X(Opcode)] < Chip8->V[Chip8Y(Opcode)];
+    Chip8->V[Chip8X(Opcode)] = Chip8->V[Chip8Y(Opcode)] - Chip8->V[Chip8X(Opcode)];
+}
+
+template <int Profile>
+static void Chip8Op8xyE(Chip8System *Chip8, uint16_t Opcode) { //Shift left, Vx or Vy depending on the profile
+    constexpr bool ShiftVy = Chip8QuirkProfiles[Profile].ShiftVy;
+    Chip8->V[15] = Chip8->V[ShiftVy ? Chip8Y(Opcode) : Chip8X(Opcode)] >> 7;
+    Chip8->V[Chip8X(Opcode)] = Chip8->V[ShiftVy ? Chip8Y(Opcode) : Chip8X(Opcode)] << 1;
+}
+
+static void Chip8Op9xy0(Chip8System *Chip8, uint16_t Opcode) { //Skip next instruction if Vx != Vy
+    if (Chip8->V[Chip8X(Opcode)] != Chip8->V[Chip8Y(Opcode)]) {
+        Chip8->PC += 2;
+    }
+}
+
+static void Chip8OpAnnn(Chip8System *Chip8, uint16_t Opcode) { //Load I with nnn
+    Chip8->I = Chip8NNN(Opcode);
+}
+
+template <int Profile>
+static void Chip8OpBnnn(Chip8System *Chip8, uint16_t Opcode) { //Jump to location nnn + V0, or nnn + Vx
+    Chip8->PC = Chip8NNN(Opcode) + Chip8->V[Chip8QuirkProfiles[Profile].JumpVx ? Chip8X(Opcode) : 0] - 2; //PC is incremented after this, like 1nnn
+}
+
+static void Chip8OpCxkk(Chip8System *Chip8, uint16_t Opcode) { //Load Vx with random number and kk
+    Chip8->V[Chip8X(Opcode)] = Chip8Random(Chip8) & Chip8KK(Opcode);
+}
+
+template <int Profile>
+static void Chip8OpDxyn(Chip8System *Chip8, uint16_t Opcode) { //Draw sprite
+    Chip8->V[15] = Chip8DrawSpriteRows<Chip8QuirkProfiles[Profile].WrapSprites>(Chip8, Chip8->V[Chip8X(Opcode)], Chip8->V[Chip8Y(Opcode)], Chip8->I, Chip8N(Opcode));
+}
+
+static void Chip8OpEx9E(Chip8System *Chip8, uint16_t Opcode) { //Skip instruction if key is pressed
+    Chip8->KeyPolled = 1;
+    if ((Chip8->Chip8KeyPad >> (Chip8->V[Chip8X(Opcode)] & 0xF)) & 1) {
+        Chip8->PC += 2;
+    }
+}
+
+static void Chip8OpExA1(Chip8System *Chip8, uint16_t Opcode) { //Skip instruction if key is not pressed
+    Chip8->KeyPolled = 1;
+    if (((Chip8->Chip8KeyPad >> (Chip8->V[Chip8X(Opcode)] & 0xF)) & 1) == 0) {
+        Chip8->PC += 2;
+    }
+}
+
+static void Chip8OpFx07(Chip8System *Chip8, uint16_t Opcode) { //Set Vx to Delay Timer
+    Chip8->V[Chip8X(Opcode)] = Chip8DelayTimer(Chip8);
+}
+
+static void Chip8OpFx0A(Chip8System *Chip8, uint16_t Opcode) { //Wait for keypress then store in Vx
+    Chip8->KeyPolled = 1;
+    for (int i = 0; i < 16; i++) {
+        if ((Chip8->Chip8KeyPad >> i) & 1) {
+            Chip8->V[Chip8X(Opcode)] = i;
+            return;
+        }
+    }
+    Chip8->PC -= 2; //No key yet, run this instruction again.
+    Chip8->ExitReason = CHIP8_EXIT_KEYWAIT;
+}
+
+static void Chip8OpFx15(Chip8System *Chip8, uint16_t Opcode) { //Set delay timer to Vx
+    Chip8SetDelayTimer(Chip8, Chip8->V[Chip8X(Opcode)]);
+}
+
+static void Chip8OpFx18(Chip8System *Chip8, uint16_t Opcode) { //Set sound timer to Vx
+    Chip8SetSoundTimer(Chip8, Chip8->V[Chip8X(Opcode)]);
+}
+
+static void Chip8OpFx1E(Chip8System *Chip8, uint16_t Opcode) { //Set I equal to I + Vx
+    Chip8->I = (Chip8->I + Chip8->V[Chip8X(Opcode)]) & 0xFFF; //I only has 12 bits
+}
+
+static void Chip8OpFx29(Chip8System *Chip8, uint16_t Opcode) { //Set I equal to location of the sprite for Digit at Vx
+    Chip8->I = 0x50 + (Chip8->V[Chip8X(Opcode)] & 0xF) * 5; //The font starts at 0x50, 5 bytes per digit
+}
+
+static void Chip8OpFx33(Chip8System *Chip8, uint16_t Opcode) { //Store the decimal representation of Vx at I, I+1, and I+2
+    uint8_t Value = Chip8->V[Chip8X(Opcode)];
+    Chip8->Chip8Memory[Chip8->I] = Value / 100;
+    Chip8->Chip8Memory[(Chip8->I + 1) & 0xFFF] = (Value / 10) % 10;
+    Chip8->Chip8Memory[(Chip8->I + 2) & 0xFFF] = Value % 10;
+    Chip8InvalidateCode(Chip8, Chip8->I, 3);
+}
+
+template <int Profile>
+static void Chip8OpFx55(Chip8System *Chip8, uint16_t Opcode) { //Store V0 to Vx in memory at location I and up
+    for (int i = 0; i <= Chip8X(Opcode); i++) {
+        Chip8->Chip8Memory[(Chip8->I + i) & 0xFFF] = Chip8->V[i];
+    }
+    Chip8InvalidateCode(Chip8, Chip8->I, Chip8X(Opcode) + 1);
+    Chip8->I = (Chip8->I + (Chip8QuirkProfiles[Profile].LoadStoreI == 0 ? 0 : Chip8X(Opcode) + Chip8QuirkProfiles[Profile].LoadStoreI - 1)) & 0xFFF;
+}
+
+template <int Profile>
+static void Chip8OpFx65(Chip8System *Chip8, uint16_t Opcode) { //Load V0 to Vx from memory at location I and up
+    for (int i = 0; i <= Chip8X(Opcode); i++) {
+        Chip8->V[i] = Chip8->Chip8Memory[(Chip8->I + i) & 0xFFF];
+    }
+    Chip8->I = (Chip8->I + (Chip8QuirkProfiles[Profile].LoadStoreI == 0 ? 0 : Chip8X(Opcode) + Chip8QuirkProfiles[Profile].LoadStoreI - 1)) & 0xFFF;
+}
+
+//The handler table is indexed by the top nibble and the low byte of the opcode, (opcode & 0xF000) >> 4 | (opcode & 0x00FF).
+//That is 4096 entries (32 KB), small enough to stay cached, but still one lookup for every opcode.
+//The middle nibble is never needed to pick a handler, 8xyN entries are just repeated for each y.
+//Every quirk profile gets its own table.
+template <int Profile>
+static constexpr std::array<Chip8OpHandler, 4096> Chip8BuildOpTable() {
+    std::array<Chip8OpHandler, 4096> Table {};
+
+    //Opcodes that only depend on the top nibble take every low byte.
+    const Chip8OpHandler NibbleHandlers[16] = {
+        Chip8OpNop, Chip8Op1nnn, Chip8Op2nnn, Chip8Op3xkk, Chip8Op4xkk, Chip8Op5xy0, Chip8Op6xkk, Chip8Op7xkk,
+        Chip8OpNop, Chip8Op9xy0, Chip8OpAnnn, Chip8OpBnnn<Profile>, Chip8OpCxkk, Chip8OpDxyn<Profile>, Chip8OpNop, Chip8OpNop
+    };
+    for (int i = 0; i < 4096; i++) {
+        Table[i] = NibbleHandlers[i >> 8];
+    }
+
+    Table[0x0E0] = Chip8Op00E0;
+    Table[0x0EE] = Chip8Op00EE;
+
+    //8xyN only looks at the low nibble.
+    const Chip8OpHandler MathHandlers[16] = {
+        Chip8Op8xy0, Chip8Op8xy1<Profile>, Chip8Op8xy2<Profile>, Chip8Op8xy3<Profile>, Chip8Op8xy4, Chip8Op8xy5, Chip8Op8xy6<Profile>, Chip8Op8xy7,
+        Chip8OpNop, Chip8OpNop, Chip8OpNop, Chip8OpNop, Chip8OpNop, Chip8OpNop, Chip8Op8xyE<Profile>, Chip8OpNop
+    };
+    for (int y = 0; y < 16; y++) {
+        for (int n = 0; n < 16; n++) {
+            Table[0x800 | y << 4 | n] = MathHandlers[n];
+        }
+    }
+
+    Table[0xE9E] = Chip8OpEx9E;
+    Table[0xEA1] = Chip8OpExA1;
+
+    Table[0xF07] = Chip8OpFx07;
+    Table[0xF0A] = Chip8OpFx0A;
+    Table[0xF15] = Chip8OpFx15;
+    Table[0xF18] = Chip8OpFx18;
+    Table[0xF1E] = Chip8OpFx1E;
+    Table[0xF29] = Chip8OpFx29;
+    Table[0xF33] = Chip8OpFx33;
+    Table[0xF55] = Chip8OpFx55<Profile>;
+    Table[0xF65] = Chip8OpFx65<Profile>;
+    return Table;
+}
+
+static constexpr std::array<Chip8OpHandler, 4096> Chip8OpTables[CHIP8_QUIRK_PROFILES] = {
+    Chip8BuildOpTable<CHIP8_QUIRKS_VIP>(), Chip8BuildOpTable<CHIP8_QUIRKS_CHIP48>(),
+    Chip8BuildOpTable<CHIP8_QUIRKS_SCHIP>(), Chip8BuildOpTable<CHIP8_QUIRKS_XOCHIP>()
+};
+
+//Quirk dependent handlers have one instance per profile, true if Handler is any of them.
+#define CHIP8_IS_OP(Handler, Op) ((Handler) == Op<CHIP8_QUIRKS_VIP> || (Handler) == Op<CHIP8_QUIRKS_CHIP48> || \
+                                  (Handler) == Op<CHIP8_QUIRKS_SCHIP> || (Handler) == Op<CHIP8_QUIRKS_XOCHIP>)
+
+//Decodes with the handlers for the ROM's quirk profile.
+static inline Chip8OpHandler Chip8Lookup(const Chip8System *Chip8, uint16_t opcode) {
+    return Chip8OpTables[Chip8->Quirks][(opcode & 0xF000) >> 4 | (opcode & 0x00FF)];
+}
+
+static inline Chip8Decoded Chip8Decode(const Chip8System *Chip8, uint16_t opcode) {
+    return {Chip8Lookup(Chip8, opcode), opcode};
+}
+
+void Chip8CPU(Chip8System *Chip8, uint16_t opcode) {
+    Chip8Lookup(Chip8, opcode)(Chip8, opcode);
+}
+
+//Pre-decoded Instruction Cache
+//Stale entries point at this handler, it decodes whatever is in memory at the entry's address now, caches it and runs it.
+//Only Chip8RunCached runs cache entries, always the one for PC, so PC is the entry's address.
+static void Chip8OpDecodeMiss(Chip8System *Chip8, uint16_t) {
+    uint16_t Address = Chip8->PC;
+    Chip8Decoded *Entry = &Chip8->DecodeCache[Address >> 1];
+
+    *Entry = Chip8Decode(Chip8, Chip8->Chip8Memory[Address] << 8 | Chip8->Chip8Memory[Address + 1]);
+    Entry->Handler(Chip8, Entry->Opcode);
+}
+
+void Chip8ResetDecodeCache(Chip8System *Chip8) {
+    for (int i = 0; i < 2048; i++) {
+        Chip8->DecodeCache[i].Handler = Chip8OpDecodeMiss;
+    }
+}
+
+//Runs a slice of instructions out of the decode cache, hot loops skip both the fetch and the decode.
+//Instructions at odd addresses can't be cached, so they are decoded every time.
+int Chip8RunCached(Chip8System *Chip8, int Cycles) {
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        Chip8->PC &= 0xFFF;
+        if (Chip8->PC & 1) {
+            Chip8Step(Chip8);
+        }
+        else {
+            const Chip8Decoded *Op = &Chip8->DecodeCache[(Chip8->PC >> 1) & 0x7FF];
+            Op->Handler(Chip8, Op->Opcode);
+            Chip8->PC += 2;
+        }
+        Done++;
+    }
+    return Done;
+}
+
+//Basic Block Translation Cache
+//Code is split into basic blocks, straight runs of instructions that end at the first jump, call, return, skip, key wait or memory write.
+//Each block is translated once into a flat run of Chip8Decoded micro-ops and then executed start to finish without going back to the scheduler.
+//Only the last micro-op of a block can read or change PC, so PC is only written once per block.
+//Blocks that end in 1nnn or 2nnn remember the block at their target and jump straight to it next time (block chaining).
+
+//Opcodes that end a basic block, because they change PC, or because they write memory that may hold code.
+static bool Chip8EndsBlock(Chip8OpHandler Handler) {
+    return Handler == Chip8Op00E0 || CHIP8_IS_OP(Handler, Chip8OpDxyn) || Handler == Chip8OpFx18 || Handler == Chip8Op00EE || Handler == Chip8Op1nnn || Handler == Chip8Op2nnn || CHIP8_IS_OP(Handler, Chip8OpBnnn) ||
+           Handler == Chip8Op3xkk || Handler == Chip8Op4xkk || Handler == Chip8Op5xy0 || Handler == Chip8Op9xy0 ||
+           Handler == Chip8OpEx9E || Handler == Chip8OpExA1 || Handler == Chip8OpFx0A ||
+           Handler == Chip8OpFx33 || CHIP8_IS_OP(Handler, Chip8OpFx55);
+}
+
+void Chip8FlushBlocks(Chip8System *Chip8) {
+    for (int a = 0; a < 4096; a++) {
+        Chip8->BlockMap[a] = -1;
+        Chip8->CodeMap[a] = 0;
+    }
+    Chip8->BlockCount = 0;
+    Chip8->BlockOpCount = 0;
+    Chip8->BlockGeneration++;
+}
+
+//Drops every block that covers one of the written bytes, along with any chains into it.
+static void Chip8JitInvalidate(Chip8System *Chip8, uint16_t Address, int Length);
+#ifdef CHIP8_AOT
+static void Chip8AOTInvalidate(Chip8System *Chip8, uint16_t Address, int Length);
+#endif
+
+static void Chip8InvalidateBlocks(Chip8System *Chip8, uint16_t Address, int Length) {
+#ifdef CHIP8_JIT_AVAILABLE
+    if (Chip8->Jit != nullptr) {
+        Chip8JitInvalidate(Chip8, Address, Length);
+    }
+#endif
+#ifdef CHIP8_AOT
+    Chip8AOTInvalidate(Chip8, Address, Length);
+#endif
+    for (int b = 0; b < Chip8->BlockCount; b++) {
+        Chip8Block *Block = &Chip8->Blocks[b];
+        if (Block->End > Address && Block->Start < Address + Length && Chip8->BlockMap[Block->Start] == b) {
+            Chip8->BlockMap[Block->Start] = -1;
+            for (int c = 0; c < Chip8->BlockCount; c++) {
+                if (Chip8->Blocks[c].Next == b) {
+                    Chip8->Blocks[c].Next = -1;
+                }
+            }
+        }
+    }
+}
+
+//Returns the block starting at Address, translating it first if needed.
+static int Chip8LookupBlock(Chip8System *Chip8, uint16_t Address) {
+    if (Chip8->BlockMap[Address & 0xFFF] >= 0) {
+        return Chip8->BlockMap[Address & 0xFFF];
+    }
+
+    //Out of room, start over with an empty cache.
+    if (Chip8->BlockCount == 1024 || Chip8->BlockOpCount + 64 > 4096) {
+        Chip8FlushBlocks(Chip8);
+    }
+
+    int Index = Chip8->BlockCount++;
+    Chip8Block *Block = &Chip8->Blocks[Index];
+    Block->Start = Address & 0xFFF;
+    Block->First = Chip8->BlockOpCount;
+    Block->Count = 0;
+    Block->Next = -1;
+    Block->Chainable = 0;
+
+    uint16_t PC = Block->Start;
+    while (Block->Count < 64 && PC < 4095) {
+        Chip8Decoded Op = Chip8Decode(Chip8, Chip8->Chip8Memory[PC] << 8 | Chip8->Chip8Memory[PC + 1]);
+        Chip8->BlockOps[Chip8->BlockOpCount++] = Op;
+        Block->Count++;
+        PC += 2;
+
+        if (Chip8EndsBlock(Op.Handler)) {
+            Block->Chainable = Op.Handler == Chip8Op1nnn || Op.Handler == Chip8Op2nnn; //Targets that can never change
+            break;
+        }
+    }
+    Block->End = PC;
+
+    for (int a = Block->Start; a < Block->End && a < 4096; a++) {
+        Chip8->CodeMap[a] = 1;
+    }
+    Chip8->BlockMap[Block->Start] = Index;
+    return Index;
+}
+
+//Runs a slice of instructions one whole block at a time.
+//When a block doesn't fit in what's left of the slice only its start is run, so the slice is always exactly Cycles long.
+int Chip8RunBlocks(Chip8System *Chip8, int Cycles) {
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    int Current = -1;
+
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        if (Current < 0) {
+            Current = Chip8LookupBlock(Chip8, Chip8->PC);
+        }
+        Chip8Block *Block = &Chip8->Blocks[Current];
+
+        if (Block->Count == 0) { //The empty block at the very end of memory
+            while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+                Chip8Step(Chip8);
+                Done++;
+            }
+            break;
+        }
+        if (Block->Count > Cycles - Done) {
+            //None of the micro-ops that fit is the last one, so they leave PC alone and it only has to be moved past them.
+            const Chip8Decoded *Op = &Chip8->BlockOps[Block->First];
+            for (int i = 0; i < Cycles - Done; i++) {
+                Op[i].Handler(Chip8, Op[i].Opcode);
+            }
+            Chip8->PC = Block->Start + (Cycles - Done) * 2;
+            Done = Cycles;
+            break;
+        }
+
+        //Everything before the last micro-op leaves PC alone, so PC only has to be set before the last one runs.
+        const Chip8Decoded *Op = &Chip8->BlockOps[Block->First];
+        const Chip8Decoded *Last = Op + Block->Count - 1;
+        for (; Op < Last; Op++) {
+            Op->Handler(Chip8, Op->Opcode);
+        }
+        Chip8->PC = Block->End - 2;
+        Last->Handler(Chip8, Last->Opcode);
+        Chip8->PC += 2;
+        Done += Block->Count;
+
+        //Follow the chain if there is one, otherwise look the next block up and chain it if the jump target is fixed.
+        if (Block->Next >= 0) {
+            Current = Block->Next;
+        }
+        else {
+            int Generation = Chip8->BlockGeneration;
+            Current = Chip8LookupBlock(Chip8, Chip8->PC);
+            if (Block->Chainable && Generation == Chip8->BlockGeneration) {
+                Block->Next = Current;
+            }
+        }
+    }
+    return Done;
+}
+
+//x86-64 Dynamic Recompiler (JIT)
+//Basic blocks made of register, timer and I opcodes are compiled to native code, one host function per block.
+//Anything that touches memory, the display or the keypad (Dxyn, Fx0A, Fx33, ...) is left to the interpreter, which runs it with Chip8Step.
+//The block ends just before such an opcode, and a block that starts with one is marked CHIP8_JIT_INTERPRET so it is always stepped.
+//A guest write into a compiled block marks that block CHIP8_JIT_INTERPRET for good, so self modifying code always runs on the interpreter.
+//Up to four of the V registers a block uses most are pinned to r8b-r11b for the whole block, the rest are read and written in memory.
+//A block is passed what is left of the slice in esi and stops early once that runs out, returning how many instructions it ran.
+//VF is always set in the same order as the table handlers, VF first and then the result, so 8xyN with x or y = F gives the same answer.
+#ifdef CHIP8_JIT_AVAILABLE
+enum Chip8JitState {
+    CHIP8_JIT_NEW = 0, //Not looked at yet
+    CHIP8_JIT_NATIVE = 1, //Compiled, Code is set
+    CHIP8_JIT_INTERPRET = 2 //Starts with an opcode the JIT doesn't handle, or was modified after being compiled
+};
+
+struct Chip8JitBlock {
+    int (*Code)(Chip8System *Chip8, int Budget); //Returns the instructions it ran, Count unless Budget ran out first
+    uint16_t Count; //Guest instructions in the block
+    uint16_t End; //One past the last guest byte
+    uint8_t State;
+};
+
+struct Chip8Jit {
+    uint8_t *Buffer; //Executable memory
+    size_t Used, Capacity;
+    Chip8JitBlock Blocks[4096]; //Indexed by start address
+};
+
+//Host registers, numbered the way x86 encodes them.
+enum {
+    CHIP8_RAX = 0, CHIP8_RCX = 1, CHIP8_RDX = 2, CHIP8_RSI = 6, CHIP8_RDI = 7, CHIP8_R8 = 8
+};
+
+//The Chip8System pointer stays in the register the host ABI passes the first argument in.
+#ifdef _WIN32
+static const int Chip8JitBase = CHIP8_RCX;
+#else
+static const int Chip8JitBase = CHIP8_RDI;
+#endif
+
+//Longest block the JIT compiles, blocks check the budget before each instruction so they can be longer than a slice.
+static const int Chip8JitMaxBlock = 64;
+
+struct Chip8Emitter {
+    uint8_t *Code;
+    size_t Size;
+    int Pinned[16]; //Host register for each V register, -1 if it lives in memory
+};
+
+static void Chip8Emit(Chip8Emitter *E, std::initializer_list<uint8_t> Bytes) {
+    for (uint8_t b : Bytes) {
+        E->Code[E->Size++] = b;
+    }
+}
+
+static void Chip8Emit32(Chip8Emitter *E, uint32_t Value) {
+    Chip8Emit(E, {(uint8_t)Value, (uint8_t)(Value >> 8), (uint8_t)(Value >> 16), (uint8_t)(Value >> 24)});
+}
+
+//ModRM for [base + disp32] followed by the displacement.
+static void Chip8EmitMem(Chip8Emitter *E, int Reg, uint32_t Offset) {
+    Chip8Emit(E, {(uint8_t)(0x80 | (Reg & 7) << 3 | (Chip8JitBase & 7))});
+    Chip8Emit32(E, Offset);
+}
+
+//movzx Scratch32, Vx
+static void Chip8EmitLoadV(Chip8Emitter *E, int Scratch, int x) {
+    if (E->Pinned[x] >= 0) {
+        Chip8Emit(E, {0x41, 0x0F, 0xB6, (uint8_t)(0xC0 | Scratch << 3 | (E->Pinned[x] & 7))});
+    }
+    else {
+        Chip8Emit(E, {0x0F, 0xB6});
+        Chip8EmitMem(E, Scratch, offsetof(Chip8System, V) + x);
+    }
+}
+
+//mov Vx, Scratch8
+static void Chip8EmitStoreV(Chip8Emitter *E, int x, int Scratch) {
+    if (E->Pinned[x] >= 0) {
+        Chip8Emit(E, {0x41, 0x88, (uint8_t)(0xC0 | Scratch << 3 | (E->Pinned[x] & 7))});
+    }
+    else {
+        Chip8Emit(E, {0x88});
+        Chip8EmitMem(E, Scratch, offsetof(Chip8System, V) + x);
+    }
+}
+
+//Opcodes the JIT can compile. The block has to end after the ones that change PC.
+static bool Chip8JitSupported(Chip8OpHandler Handler) {
+    return Handler == Chip8Op1nnn || Handler == Chip8Op3xkk || Handler == Chip8Op4xkk || Handler == Chip8Op5xy0 ||
+           Handler == Chip8Op6xkk || Handler == Chip8Op7xkk || Handler == Chip8Op8xy0 || CHIP8_IS_OP(Handler, Chip8Op8xy1) ||
+           CHIP8_IS_OP(Handler, Chip8Op8xy2) || CHIP8_IS_OP(Handler, Chip8Op8xy3) || Handler == Chip8Op8xy4 || Handler == Chip8Op8xy5 ||
+           CHIP8_IS_OP(Handler, Chip8Op8xy6) || Handler == Chip8Op8xy7 || CHIP8_IS_OP(Handler, Chip8Op8xyE) || Handler == Chip8Op9xy0 ||
+           Handler == Chip8OpAnnn || Handler == Chip8OpFx07 || Handler == Chip8OpFx15 ||
+           Handler == Chip8OpFx1E || Handler == Chip8OpFx29 || Handler == Chip8OpNop;
+}
+
+//Emits one guest instruction for the given quirk profile. Returns true if it ended the block, in which case edx holds the new PC.
+static bool Chip8EmitOp(Chip8Emitter *E, const Chip8Decoded *Op, uint16_t Address, const Chip8Quirks *Quirks) {
+    Chip8OpHandler H = Op->Handler;
+    uint8_t x = Chip8X(Op->Opcode), y = Chip8Y(Op->Opcode), kk = Chip8KK(Op->Opcode);
+    uint16_t nnn = Chip8NNN(Op->Opcode);
+
+    if (H == Chip8Op6xkk) {
+        Chip8Emit(E, {0xB8}); Chip8Emit32(E, kk); //mov eax, kk
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (H == Chip8Op7xkk) {
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        Chip8Emit(E, {0x05}); Chip8Emit32(E, kk); //add eax, kk
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (H == Chip8Op8xy0) {
+        Chip8EmitLoadV(E, CHIP8_RAX, y);
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (CHIP8_IS_OP(H, Chip8Op8xy1) || CHIP8_IS_OP(H, Chip8Op8xy2) || CHIP8_IS_OP(H, Chip8Op8xy3)) {
+        uint8_t Opcode = CHIP8_IS_OP(H, Chip8Op8xy1) ? 0x09 : CHIP8_IS_OP(H, Chip8Op8xy2) ? 0x21 : 0x31; //or, and, xor eax, edx
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        Chip8EmitLoadV(E, CHIP8_RDX, y);
+        Chip8Emit(E, {Opcode, 0xD0});
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+        if (Quirks->ResetVF) {
+            Chip8Emit(E, {0x31, 0xC0}); //xor eax, eax
+            Chip8EmitStoreV(E, 15, CHIP8_RAX);
+        }
+    }
+    else if (H == Chip8Op8xy4) {
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        Chip8EmitLoadV(E, CHIP8_RDX, y);
+        Chip8Emit(E, {0x01, 0xD0}); //add eax, edx
+        Chip8Emit(E, {0x89, 0xC2}); //mov edx, eax
+        Chip8Emit(E, {0xC1, 0xEA, 0x08}); //shr edx, 8, the carry
+        Chip8EmitStoreV(E, 15, CHIP8_RDX);
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (H == Chip8Op8xy5 || H == Chip8Op8xy7) {
+        //8xy5: VF = Vx > Vy, then Vx = Vx - Vy. 8xy7: VF = Vx < Vy, then Vx = Vy - Vx.
+        bool Reverse = H == Chip8Op8xy7;
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        Chip8EmitLoadV(E, CHIP8_RDX, y);
+        Chip8Emit(E, {0x39, 0xD0}); //cmp eax, edx
+        Chip8Emit(E, {0x0F, (uint8_t)(Reverse ? 0x92 : 0x97), 0xC0}); //setb al / seta al
+        Chip8Emit(E, {0x0F, 0xB6, 0xC0}); //movzx eax, al
+        Chip8EmitStoreV(E, 15, CHIP8_RAX);
+
+        Chip8EmitLoadV(E, CHIP8_RAX, Reverse ? y : x);
+        Chip8EmitLoadV(E, CHIP8_RDX, Reverse ? x : y);
+        Chip8Emit(E, {0x29, 0xD0}); //sub eax, edx
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (CHIP8_IS_OP(H, Chip8Op8xy6) || CHIP8_IS_OP(H, Chip8Op8xyE)) {
+        bool Left = CHIP8_IS_OP(H, Chip8Op8xyE);
+        int Source = Quirks->ShiftVy ? y : x;
+        Chip8EmitLoadV(E, CHIP8_RAX, Source);
+        if (Left) {
+            Chip8Emit(E, {0xC1, 0xE8, 0x07}); //shr eax, 7
+        }
+        else {
+            Chip8Emit(E, {0x83, 0xE0, 0x01}); //and eax, 1
+        }
+        Chip8EmitStoreV(E, 15, CHIP8_RAX);
+        Chip8EmitLoadV(E, CHIP8_RAX, Source);
+        Chip8Emit(E, {0xD1, (uint8_t)(Left ? 0xE0 : 0xE8)}); //shl eax, 1 / shr eax, 1
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (H == Chip8OpAnnn) {
+        Chip8Emit(E, {0x66, 0xC7}); //mov word [I], nnn
+        Chip8EmitMem(E, 0, offsetof(Chip8System, I));
+        Chip8Emit(E, {(uint8_t)nnn, (uint8_t)(nnn >> 8)});
+    }
+    else if (H == Chip8OpFx1E) {
+        Chip8EmitLoadV(E, CHIP8_RDX, x);
+        Chip8Emit(E, {0x66, 0x01}); //add word [I], dx
+        Chip8EmitMem(E, CHIP8_RDX, offsetof(Chip8System, I));
+        Chip8Emit(E, {0x66, 0x81}); //and word [I], 0xFFF
+        Chip8EmitMem(E, 4, offsetof(Chip8System, I));
+        Chip8Emit(E, {0xFF, 0x0F});
+    }
+    else if (H == Chip8OpFx29) {
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        Chip8Emit(E, {0x83, 0xE0, 0x0F}); //and eax, 0xF
+        Chip8Emit(E, {0x8D, 0x44, 0x80, 0x50}); //lea eax, [rax + rax * 4 + 0x50]
+        Chip8Emit(E, {0x66, 0x89}); //mov word [I], ax
+        Chip8EmitMem(E, CHIP8_RAX, offsetof(Chip8System, I));
+    }
+    else if (H == Chip8OpFx07) {
+        //The timer is DelayExpiry - Ticks, or 0 once that would go below zero
+        Chip8Emit(E, {0x31, 0xD2}); //xor edx, edx
+        Chip8Emit(E, {0x48, 0x8B}); //mov rax, [DelayExpiry]
+        Chip8EmitMem(E, CHIP8_RAX, offsetof(Chip8System, DelayExpiry));
+        Chip8Emit(E, {0x48, 0x2B}); //sub rax, [Ticks]
+        Chip8EmitMem(E, CHIP8_RAX, offsetof(Chip8System, Ticks));
+        Chip8Emit(E, {0x0F, 0x42, 0xC2}); //cmovb eax, edx
+        Chip8EmitStoreV(E, x, CHIP8_RAX);
+    }
+    else if (H == Chip8OpFx15) {
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        Chip8Emit(E, {0x48, 0x03}); //add rax, [Ticks]
+        Chip8EmitMem(E, CHIP8_RAX, offsetof(Chip8System, Ticks));
+        Chip8Emit(E, {0x48, 0x89}); //mov [DelayExpiry], rax
+        Chip8EmitMem(E, CHIP8_RAX, offsetof(Chip8System, DelayExpiry));
+    }
+    else if (H == Chip8Op1nnn) {
+        Chip8Emit(E, {0xBA}); Chip8Emit32(E, nnn); //mov edx, nnn
+        return true;
+    }
+    else if (H == Chip8Op3xkk || H == Chip8Op4xkk || H == Chip8Op5xy0 || H == Chip8Op9xy0) {
+        Chip8EmitLoadV(E, CHIP8_RAX, x);
+        if (H == Chip8Op3xkk || H == Chip8Op4xkk) {
+            Chip8Emit(E, {0x3D}); Chip8Emit32(E, kk); //cmp eax, kk
+        }
+        else {
+            Chip8EmitLoadV(E, CHIP8_RDX, y);
+            Chip8Emit(E, {0x39, 0xD0}); //cmp eax, edx
+        }
+        bool SkipIfEqual = H == Chip8Op3xkk || H == Chip8Op5xy0;
+        Chip8Emit(E, {0x0F, (uint8_t)(SkipIfEqual ? 0x94 : 0x95), 0xC0}); //sete al / setne al
+        Chip8Emit(E, {0x0F, 0xB6, 0xC0}); //movzx eax, al
+        Chip8Emit(E, {0x8D, 0x14, 0x45}); Chip8Emit32(E, Address + 2); //lea edx, [rax * 2 + next], skips one more instruction if the test passed
+        return true;
+    }
+    //Chip8OpNop compiles to nothing.
+    return false;
+}
+
+//Compiles the block starting at Address, or marks it for the interpreter if its first opcode can't be compiled.
+static void Chip8JitTranslate(Chip8System *Chip8, uint16_t Address) {
+    Chip8Jit *Jit = Chip8->Jit;
+    Chip8JitBlock *Block = &Jit->Blocks[Address];
+
+    Chip8Decoded Ops[Chip8JitMaxBlock];
+    int Count = 0;
+    uint16_t PC = Address;
+    bool EndsWithBranch = false;
+    while (Count < Chip8JitMaxBlock && PC < 4095) {
+        Chip8Decoded Op = Chip8Decode(Chip8, Chip8->Chip8Memory[PC] << 8 | Chip8->Chip8Memory[PC + 1]);
+        if (!Chip8JitSupported(Op.Handler)) {
+            break;
+        }
+        Ops[Count++] = Op;
+        PC += 2;
+        if (Chip8EndsBlock(Op.Handler)) {
+            EndsWithBranch = true;
+            break;
+        }
+    }
+
+    if (Count == 0) {
+        Block->State = CHIP8_JIT_INTERPRET;
+        return;
+    }
+
+    //A full buffer is simply thrown away and compiled again as blocks get used.
+    if (Jit->Capacity - Jit->Used < 16384) {
+        for (int a = 0; a < 4096; a++) {
+            Jit->Blocks[a].State = Jit->Blocks[a].State == CHIP8_JIT_NATIVE ? (uint8_t)CHIP8_JIT_NEW : Jit->Blocks[a].State;
+        }
+        Jit->Used = 0;
+    }
+
+    //Pin the four V registers that show up the most, as long as they are used at least twice.
+    int Uses[16] = {0};
+    for (int i = 0; i < Count; i++) {
+        Uses[Chip8X(Ops[i].Opcode)]++;
+        Uses[Chip8Y(Ops[i].Opcode)]++;
+        Uses[15]++; //Close enough, most of the math opcodes write VF
+    }
+    Chip8Emitter E;
+    E.Code = Jit->Buffer + Jit->Used;
+    E.Size = 0;
+    for (int r = 0; r < 16; r++) {
+        E.Pinned[r] = -1;
+    }
+#ifdef _WIN32
+    Chip8Emit(&E, {0x56, 0x89, 0xD6}); //push rsi, mov esi, edx (rsi is callee saved on Windows)
+#endif
+    for (int Host = CHIP8_R8; Host < CHIP8_R8 + 4; Host++) {
+        int Best = -1;
+        for (int r = 0; r < 16; r++) {
+            if (E.Pinned[r] < 0 && Uses[r] >= 2 && (Best < 0 || Uses[r] > Uses[Best])) {
+                Best = r;
+            }
+        }
+        if (Best < 0) {
+            break;
+        }
+        E.Pinned[Best] = Host;
+        Chip8Emit(&E, {0x44, 0x0F, 0xB6}); //movzx r8d-r11d, byte [V + Best]
+        Chip8EmitMem(&E, Host, offsetof(Chip8System, V) + Best);
+    }
+
+    size_t Exits[Chip8JitMaxBlock]; //Where each budget check's jump offset goes
+    for (int i = 0; i < Count; i++) {
+        if (i > 0) {
+            Chip8Emit(&E, {0x83, 0xFE, (uint8_t)i}); //cmp esi, i
+            Chip8Emit(&E, {0x0F, 0x8E}); //jle exit i
+            Exits[i] = E.Size;
+            Chip8Emit32(&E, 0);
+        }
+        Chip8EmitOp(&E, &Ops[i], Address + i * 2, &Chip8QuirkProfiles[Chip8->Quirks]);
+    }
+    if (!EndsWithBranch) {
+        Chip8Emit(&E, {0xBA}); Chip8Emit32(&E, PC); //mov edx, next address
+    }
+    Chip8Emit(&E, {0xB8}); Chip8Emit32(&E, Count); //mov eax, Count
+
+    //Write PC and the pinned registers back, then return.
+    size_t Tail = E.Size;
+    Chip8Emit(&E, {0x66, 0x89});
+    Chip8EmitMem(&E, CHIP8_RDX, offsetof(Chip8System, PC));
+    for (int r = 0; r < 16; r++) {
+        if (E.Pinned[r] >= 0) {
+            Chip8Emit(&E, {0x44, 0x88}); //mov byte [V + r], r8b-r11b
+            Chip8EmitMem(&E, E.Pinned[r], offsetof(Chip8System, V) + r);
+        }
+    }
+#ifdef _WIN32
+    Chip8Emit(&E, {0x5E}); //pop rsi
+#endif
+    Chip8Emit(&E, {0xC3}); //ret
+
+    //Budget ran out before instruction i, stop with PC on it and i instructions run.
+    for (int i = 1; i < Count; i++) {
+        uint32_t Offset = (uint32_t)(E.Size - (Exits[i] + 4));
+        memcpy(E.Code + Exits[i], &Offset, 4);
+        Chip8Emit(&E, {0xBA}); Chip8Emit32(&E, Address + i * 2); //mov edx, address of instruction i
+        Chip8Emit(&E, {0xB8}); Chip8Emit32(&E, i); //mov eax, i
+        Chip8Emit(&E, {0xE9}); Chip8Emit32(&E, (uint32_t)(Tail - (E.Size + 4))); //jmp tail
+    }
+
+    Block->Code = (int (*)(Chip8System *, int))E.Code;
+    Block->Count = Count;
+    Block->End = PC;
+    Block->State = CHIP8_JIT_NATIVE;
+    Jit->Used += E.Size;
+
+    for (int a = Address; a < PC; a++) {
+        Chip8->CodeMap[a] = 1;
+    }
+}
+
+//Guest write into compiled code, every block covering those bytes goes back to the interpreter for good.
+static void Chip8JitInvalidate(Chip8System *Chip8, uint16_t Address, int Length) {
+    for (int a = Address - Chip8JitMaxBlock * 2; a < Address + Length; a++) {
+        if (a >= 0 && a < 4096) {
+            Chip8JitBlock *Block = &Chip8->Jit->Blocks[a];
+            if (Block->State == CHIP8_JIT_NATIVE && Block->End > Address) {
+                Block->State = CHIP8_JIT_INTERPRET;
+            }
+        }
+    }
+}
+
+static void Chip8JitCreate(Chip8System *Chip8) {
+    Chip8->Jit = new Chip8Jit();
+    Chip8->Jit->Capacity = 4 * 1024 * 1024;
+#ifdef _WIN32
+    Chip8->Jit->Buffer = (uint8_t *)VirtualAlloc(nullptr, Chip8->Jit->Capacity, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+    Chip8->Jit->Buffer = (uint8_t *)mmap(nullptr, Chip8->Jit->Capacity, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Chip8->Jit->Buffer == MAP_FAILED) {
+        Chip8->Jit->Buffer = nullptr;
+    }
+#endif
+    if (Chip8->Jit->Buffer == nullptr) {
+        std::cout << "Unable to allocate executable memory for the JIT, exiting...." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+//Differential mode, runs the block natively, then puts the registers back and runs it again on the interpreter.
+//Compiled blocks never touch memory, the display or the keypad, so the registers, I, PC and the timers are all that can differ.
+static int Chip8JitVerifyBlock(Chip8System *Chip8, Chip8JitBlock *Block, int Budget) {
+    uint8_t V[16];
+    uint64_t Delay = Chip8->DelayExpiry, Sound = Chip8->SoundExpiry;
+    uint16_t I = Chip8->I, PC = Chip8->PC;
+    memcpy(V, Chip8->V, 16);
+
+    int Ran = Block->Code(Chip8, Budget);
+    uint8_t JitV[16];
+    uint64_t JitDelay = Chip8->DelayExpiry, JitSound = Chip8->SoundExpiry;
+    uint16_t JitI = Chip8->I, JitPC = Chip8->PC;
+    memcpy(JitV, Chip8->V, 16);
+
+    memcpy(Chip8->V, V, 16);
+    Chip8->I = I;
+    Chip8->PC = PC;
+    Chip8->DelayExpiry = Delay;
+    Chip8->SoundExpiry = Sound;
+    for (int i = 0; i < Ran; i++) {
+        Chip8Step(Chip8);
+    }
+
+    if (memcmp(JitV, Chip8->V, 16) != 0 || JitI != Chip8->I || JitPC != Chip8->PC || JitDelay != Chip8->DelayExpiry || JitSound != Chip8->SoundExpiry) {
+        std::cout << std::hex << "JIT mismatch in the block at 0x" << PC << " (" << std::dec << Ran << " of " << Block->Count << " instructions)" << std::endl;
+        std::cout << std::hex << "  JIT:         PC " << JitPC << " I " << JitI;
+        for (int r = 0; r < 16; r++) std::cout << " V" << r << " " << (int)JitV[r];
+        std::cout << std::endl << "  Interpreter: PC " << Chip8->PC << " I " << Chip8->I;
+        for (int r = 0; r < 16; r++) std::cout << " V" << r << " " << (int)Chip8->V[r];
+        std::cout << std::dec << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return Ran;
+}
+#endif
+
+//Releases the JIT's executable memory, if the JIT core ever ran.
+void Chip8FreeJit(Chip8System *Chip8) {
+#ifdef CHIP8_JIT_AVAILABLE
+    if (Chip8->Jit == nullptr) {
+        return;
+    }
+#ifdef _WIN32
+    VirtualFree(Chip8->Jit->Buffer, 0, MEM_RELEASE);
+#else
+    munmap(Chip8->Jit->Buffer, Chip8->Jit->Capacity);
+#endif
+    delete Chip8->Jit;
+    Chip8->Jit = nullptr;
+#endif
+}
+
+//Runs a slice of instructions on the JIT, stepping the interpreter wherever there is no compiled block.
+//With Verify set every compiled block is checked against the interpreter, and the first difference stops the emulator.
+//Hosts that aren't x86-64 run the block translator instead.
+int Chip8RunJit(Chip8System *Chip8, int Cycles, bool Verify) {
+#ifdef CHIP8_JIT_AVAILABLE
+    if (Chip8->Jit == nullptr) {
+        Chip8JitCreate(Chip8);
+    }
+
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        if (Chip8->PC >= 4095) {
+            Chip8Step(Chip8);
+            Done++;
+            continue;
+        }
+
+        Chip8JitBlock *Block = &Chip8->Jit->Blocks[Chip8->PC];
+        if (Block->State == CHIP8_JIT_NEW) {
+            Chip8JitTranslate(Chip8, Chip8->PC);
+        }
+
+        if (Block->State != CHIP8_JIT_NATIVE) {
+            Chip8Step(Chip8);
+            Done++;
+            continue;
+        }
+
+        if (Verify) {
+            Done += Chip8JitVerifyBlock(Chip8, Block, Cycles - Done);
+        }
+        else {
+            Done += Block->Code(Chip8, Cycles - Done);
+        }
+    }
+    return Done;
+#else
+    return Chip8RunBlocks(Chip8, Cycles);
+#endif
+}
+
+//Ahead of Time Compiled Core
+//Runs the blocks Chip8-AOT compiled for this ROM, and steps the interpreter wherever there is no block (Bnnn targets, Fx0A, overwritten code).
+//Builds without -DCHIP8_AOT have no blocks and use the block translator instead.
+void Chip8LoadAOT(Chip8System *Chip8) {
+    for (int a = 0; a < 4096; a++) {
+        Chip8->AOTMap[a] = -1;
+    }
+#ifdef CHIP8_AOT
+    //The blocks only match the ROM and the quirk profile they were made for.
+    if (Chip8AOTRomSize > 3584 || memcmp(Chip8->Chip8Memory + 0x200, Chip8AOTRom, Chip8AOTRomSize) != 0) {
+        if (Chip8->CPUCore == CHIP8_CORE_AOT) {
+            std::cout << "This build was compiled ahead of time for a different ROM, running on the interpreter." << std::endl;
+        }
+        return;
+    }
+    if (Chip8AOTQuirks != Chip8->Quirks) {
+        if (Chip8->CPUCore == CHIP8_CORE_AOT) {
+            std::cout << "This build was compiled ahead of time with " << Chip8QuirkProfiles[Chip8AOTQuirks].Name << " quirks, running on the interpreter." << std::endl;
+        }
+        return;
+    }
+    for (int b = 0; b < Chip8AOTBlockCount; b++) {
+        Chip8->AOTMap[Chip8AOTBlocks[b].Start] = b;
+        for (int a = Chip8AOTBlocks[b].Start; a < Chip8AOTBlocks[b].End; a++) {
+            Chip8->CodeMap[a] = 1;
+        }
+    }
+#else
+    if (Chip8->CPUCore == CHIP8_CORE_AOT) {
+        std::cout << "This build has no ahead of time compiled blocks linked in (see make aot), running on the block translator." << std::endl;
+    }
+#endif
+}
+
+#ifdef CHIP8_AOT
+//Guest write into compiled code, blocks are at most 8 instructions long (MaxBlockLength in chip8aot.cpp) so only the last 16 bytes can reach the write.
+static void Chip8AOTInvalidate(Chip8System *Chip8, uint16_t Address, int Length) {
+    for (int a = Address - 16; a < Address + Length; a++) {
+        if (a >= 0 && a < 4096 && Chip8->AOTMap[a] >= 0 && Chip8AOTBlocks[Chip8->AOTMap[a]].End > Address) {
+            Chip8->AOTMap[a] = -1;
+        }
+    }
+}
+#endif
+
+int Chip8RunAOT(Chip8System *Chip8, int Cycles) {
+#ifdef CHIP8_AOT
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        int Index = Chip8->PC < 4096 ? Chip8->AOTMap[Chip8->PC] : -1;
+        if (Index < 0 || Chip8AOTBlocks[Index].Count > Cycles - Done) {
+            Chip8Step(Chip8);
+            Done++;
+            continue;
+        }
+        Chip8AOTBlocks[Index].Run(Chip8);
+        Done += Chip8AOTBlocks[Index].Count;
+    }
+    return Done;
+#else
+    return Chip8RunBlocks(Chip8, Cycles);
+#endif
+}
+
+//Threaded Interpreter Core
+//Uses the GCC/Clang "labels as values" extension, every handler ends by fetching the next opcode and jumping straight to its handler.
+//Each handler gets its own indirect jump, which the host's branch predictor can learn far better than the single jump of a switch.
+//V, I, PC and SP are copied into locals for the whole slice and written back at the end, so they can live in host registers.
+//Unlike Chip8Step, PC is advanced before the handler runs, so jumps set PC directly. The visible state matches the other cores after every instruction.
+//There is one copy of the core per quirk profile. Returns the number of instructions executed.
+template <int Profile>
+static int Chip8RunThreadedProfile(Chip8System *Chip8, int Cycles) {
+#if defined(__GNUC__)
+    constexpr Chip8Quirks Quirks = Chip8QuirkProfiles[Profile];
+    uint8_t *Memory = Chip8->Chip8Memory;
+    uint8_t V[16];
+    memcpy(V, Chip8->V, 16);
+    uint16_t I = Chip8->I;
+    uint16_t PC = Chip8->PC;
+    uint16_t SP = Chip8->SP;
+    uint16_t Opcode;
+    int Remaining = Cycles;
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+
+    static void *const NibbleLabels[16] = {
+        &&Op0, &&Op1nnn, &&Op2nnn, &&Op3xkk, &&Op4xkk, &&Op5xy0, &&Op6xkk, &&Op7xkk,
+        &&Op8, &&Op9xy0, &&OpAnnn, &&OpBnnn, &&OpCxkk, &&OpDxyn, &&OpE, &&OpF
+    };
+    static void *const MathLabels[16] = {
+        &&Op8xy0, &&Op8xy1, &&Op8xy2, &&Op8xy3, &&Op8xy4, &&Op8xy5, &&Op8xy6, &&Op8xy7,
+        &&OpNop, &&OpNop, &&OpNop, &&OpNop, &&OpNop, &&OpNop, &&Op8xyE, &&OpNop
+    };
+
+//Fetch the next opcode and jump to its handler, or leave once the slice is used up.
+#define CHIP8_DISPATCH() \
+    do { \
+        if (Remaining-- == 0) goto Exit; \
+        PC &= 0xFFF; \
+        Opcode = Memory[PC] << 8 | Memory[(PC + 1) & 0xFFF]; \
+        PC += 2; \
+        goto *NibbleLabels[Opcode >> 12]; \
+    } while (0)
+#define X ((Opcode & 0x0F00) >> 8)
+#define Y ((Opcode & 0x00F0) >> 4)
+
+    CHIP8_DISPATCH();
+
+    Op0:
+        if ((Opcode & 0x00FF) == 0x00E0) { //Clear Screen
+            Chip8ClearDisplay(Chip8);
+        }
+        else if ((Opcode & 0x00FF) == 0x00EE) { //Return from Subroutine, the stack holds the address of the call itself
+            PC = Chip8->Stack[SP] + 2;
+            SP++;
+        }
+        if (Chip8->ExitReason != CHIP8_EXIT_BUDGET) goto Exit;
+        CHIP8_DISPATCH();
+    Op1nnn: //Jump
+        PC = Opcode & 0x0FFF;
+        CHIP8_DISPATCH();
+    Op2nnn: //Call subroutine
+        SP--;
+        Chip8->Stack[SP] = PC - 2;
+        PC = Opcode & 0x0FFF;
+        CHIP8_DISPATCH();
+    Op3xkk: //Skip next instruction if Vx == kk
+        if (V[X] == (Opcode & 0x00FF)) PC += 2;
+        CHIP8_DISPATCH();
+    Op4xkk: //Skip next instruction if Vx != kk
+        if (V[X] != (Opcode & 0x00FF)) PC += 2;
+        CHIP8_DISPATCH();
+    Op5xy0: //Skip next instruction if Vx == Vy
+        if (V[X] == V[Y]) PC += 2;
+        CHIP8_DISPATCH();
+    Op6xkk: //Load Vx with kk
+        V[X] = Opcode & 0x00FF;
+        CHIP8_DISPATCH();
+    Op7xkk: //Add kk to Vx
+        V[X] += Opcode & 0x00FF;
+        CHIP8_DISPATCH();
+    Op8:
+        goto *MathLabels[Opcode & 0x000F];
+    Op8xy0: //LD Vx, Vy
+        V[X] = V[Y];
+        CHIP8_DISPATCH();
+    Op8xy1: //OR Vx, Vy
+        V[X] |= V[Y];
+        if constexpr (Quirks.ResetVF) V[15] = 0;
+        CHIP8_DISPATCH();
+    Op8xy2: //AND Vx, Vy
+        V[X] &= V[Y];
+        if constexpr (Quirks.ResetVF) V[15] = 0;
+        CHIP8_DISPATCH();
+    Op8xy3: //XOR Vx, Vy
+        V[X] ^= V[Y];
+        if constexpr (Quirks.ResetVF) V[15] = 0;
+        CHIP8_DISPATCH();
+    Op8xy4: //ADD Vx, Vy
+    {
+        uint16_t Sum = V[X] + V[Y];
+        V[15] = Sum > 255;
+        V[X] = (uint8_t)Sum;
+        CHIP8_DISPATCH();
+    }
+    //The rest of the math opcodes write VF first and then read the registers again, the same order as the other cores.
+    Op8xy5: //SUB Vx, Vy
+        V[15] = V[X] > V[Y];
+        V[X] -= V[Y];
+        CHIP8_DISPATCH();
+    Op8xy6: //Shift right, Vx or Vy depending on the profile
+        V[15] = V[Quirks.ShiftVy ? Y : X] & 0x1;
+        V[X] = V[Quirks.ShiftVy ? Y : X] >> 1;
+        CHIP8_DISPATCH();
+    Op8xy7: //SUBN, Vx = Vy - Vx
+        V[15] = V[X] < V[Y];
+        V[X] = V[Y] - V[X];
+        CHIP8_DISPATCH();
+    Op8xyE: //Shift left, Vx or Vy depending on the profile
+        V[15] = V[Quirks.ShiftVy ? Y : X] >> 7;
+        V[X] = V[Quirks.ShiftVy ? Y : X] << 1;
+        CHIP8_DISPATCH();
+    Op9xy0: //Skip next instruction if Vx != Vy
+        if (V[X] != V[Y]) PC += 2;
+        CHIP8_DISPATCH();
+    OpAnnn: //Load I with nnn
+        I = Opcode & 0x0FFF;
+        CHIP8_DISPATCH();
+    OpBnnn: //Jump to location nnn + V0 (or Vx)
+        PC = (Opcode & 0x0FFF) + V[Quirks.JumpVx ? X : 0];
+        CHIP8_DISPATCH();
+    OpCxkk: //Load Vx with random number and kk
+        V[X] = Chip8Random(Chip8) & (Opcode & 0x00FF);
+        CHIP8_DISPATCH();
+    OpDxyn: //Draw sprite
+        V[15] = Chip8DrawSpriteRows<Quirks.WrapSprites>(Chip8, V[X], V[Y], I, Opcode & 0x000F);
+        goto Exit; //Drawing always ends the slice
+    OpE:
+        if ((Opcode & 0x00FF) == 0x009E) { //Skip instruction if key is pressed
+            Chip8->KeyPolled = 1;
+            if ((Chip8->Chip8KeyPad >> (V[X] & 0xF)) & 1) PC += 2;
+        }
+        else if ((Opcode & 0x00FF) == 0x00A1) { //Skip instruction if key is not pressed
+            Chip8->KeyPolled = 1;
+            if (((Chip8->Chip8KeyPad >> (V[X] & 0xF)) & 1) == 0) PC += 2;
+        }
+        CHIP8_DISPATCH();
+    OpF:
+        switch (Opcode & 0x00FF) {
+            case 0x0007: //Set Vx to Delay Timer
+                V[X] = Chip8DelayTimer(Chip8);
+                break;
+            case 0x000A: //Wait for keypress then store in Vx
+            {
+                Chip8->KeyPolled = 1;
+                int Key = 0;
+                while (Key < 16 && ((Chip8->Chip8KeyPad >> Key) & 1) == 0) {
+                    Key++;
+                }
+                if (Key < 16) {
+                    V[X] = Key;
+                }
+                else {
+                    PC -= 2; //No key yet, run this instruction again.
+                    Chip8->ExitReason = CHIP8_EXIT_KEYWAIT;
+                }
+                break;
+            }
+            case 0x0015: //Set delay timer to Vx
+                Chip8SetDelayTimer(Chip8, V[X]);
+                break;
+            case 0x0018: //Set sound timer to Vx
+                Chip8SetSoundTimer(Chip8, V[X]);
+                break;
+            case 0x001E: //Set I equal to I + Vx
+                I = (I + V[X]) & 0xFFF;
+                break;
+            case 0x0029: //Set I equal to location of the sprite for Digit at Vx
+                I = 0x50 + (V[X] & 0xF) * 5;
+                break;
+            case 0x0033: //Store the decimal representation of Vx at I, I+1, and I+2
+                Memory[I] = V[X] / 100;
+                Memory[(I + 1) & 0xFFF] = (V[X] / 10) % 10;
+                Memory[(I + 2) & 0xFFF] = V[X] % 10;
+                Chip8InvalidateCode(Chip8, I, 3);
+                break;
+            case 0x0055: //Store V0 to Vx in memory at location I and up
+                for (int i = 0; i <= X; i++) {
+                    Memory[(I + i) & 0xFFF] = V[i];
+                }
+                Chip8InvalidateCode(Chip8, I, X + 1);
+                I = (I + (Quirks.LoadStoreI == 0 ? 0 : X + Quirks.LoadStoreI - 1)) & 0xFFF;
+                break;
+            case 0x0065: //Load V0 to Vx from memory at location I and up
+                for (int i = 0; i <= X; i++) {
+                    V[i] = Memory[(I + i) & 0xFFF];
+                }
+                I = (I + (Quirks.LoadStoreI == 0 ? 0 : X + Quirks.LoadStoreI - 1)) & 0xFFF;
+                break;
+        }
+        if (Chip8->ExitReason != CHIP8_EXIT_BUDGET) goto Exit;
+        CHIP8_DISPATCH();
+    OpNop:
+        CHIP8_DISPATCH();
+
+#undef CHIP8_DISPATCH
+#undef X
+#undef Y
+
+    Exit:
+    memcpy(Chip8->V, V, 16);
+    Chip8->I = I;
+    Chip8->PC = PC;
+    Chip8->SP = SP;
+    return Remaining < 0 ? Cycles : Cycles - Remaining; //Remaining is -1 once the whole slice ran
+#else
+    //No computed goto on this compiler, fall back to the table core.
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        Chip8Step(Chip8);
+        Done++;
+    }
+    return Done;
+#endif
+}
+
+static int (*const Chip8ThreadedCores[CHIP8_QUIRK_PROFILES])(Chip8System *Chip8, int Cycles) = {
+    Chip8RunThreadedProfile<CHIP8_QUIRKS_VIP>, Chip8RunThreadedProfile<CHIP8_QUIRKS_CHIP48>,
+    Chip8RunThreadedProfile<CHIP8_QUIRKS_SCHIP>, Chip8RunThreadedProfile<CHIP8_QUIRKS_XOCHIP>
+};
+
+int Chip8RunThreaded(Chip8System *Chip8, int Cycles) {
+    return Chip8ThreadedCores[Chip8->Quirks](Chip8, Cycles);
+}
+
+//Runs a slice of instructions on whichever core was picked at startup.
+//Every core stops early, right after an instruction that sets Chip8->ExitReason, and returns the number of instructions it ran.
+static int Chip8RunCore(Chip8System *Chip8, int Cycles) {
+    if (Chip8->CPUCore == CHIP8_CORE_THREADED) {
+        return Chip8RunThreaded(Chip8, Cycles);
+    }
+    if (Chip8->CPUCore == CHIP8_CORE_CACHED) {
+        return Chip8RunCached(Chip8, Cycles);
+    }
+    if (Chip8->CPUCore == CHIP8_CORE_BLOCKS) {
+        return Chip8RunBlocks(Chip8, Cycles);
+    }
+    if (Chip8->CPUCore == CHIP8_CORE_JIT || Chip8->CPUCore == CHIP8_CORE_JIT_VERIFY) {
+        return Chip8RunJit(Chip8, Cycles, Chip8->CPUCore == CHIP8_CORE_JIT_VERIFY);
+    }
+    if (Chip8->CPUCore == CHIP8_CORE_AOT) {
+        return Chip8RunAOT(Chip8, Cycles);
+    }
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        Chip8Step(Chip8);
+        Done++;
+    }
+    return Done;
+}
+
+//Breakpoints only work on the table core, stepping one instruction at a time, so the other cores never have to check PC.
+static int Chip8RunDebug(Chip8System *Chip8, int Cycles) {
+    Chip8->ExitReason = CHIP8_EXIT_BUDGET;
+    int Done = 0;
+    while (Done < Cycles && Chip8->ExitReason == CHIP8_EXIT_BUDGET) {
+        Chip8Step(Chip8);
+        Done++;
+        if (Chip8->Breakpoints[Chip8->PC & 0xFFF]) {
+            Chip8->ExitReason = CHIP8_EXIT_BREAKPOINT;
+        }
+    }
+    return Done;
+}
+
+void Chip8SetBreakpoint(Chip8System *Chip8, uint16_t Address, bool Enabled) {
+    Address &= 0xFFF;
+    if (Chip8->Breakpoints[Address] != Enabled) {
+        Chip8->BreakpointCount += Enabled ? 1 : -1;
+        Chip8->Breakpoints[Address] = Enabled;
+    }
+}
+
+//Idle Loop Detection
+//Finds the loops ROMs sit in while they wait, which can't change anything until the next timer tick or key press:
+//1nnn jumping to itself, Fx0A with no key down, and Fx07 / 3xkk / 1nnn polling the delay timer until it reaches kk.
+//Returns which kind of loop PC is in, CHIP8_IDLE_NONE if it isn't in one.
+int Chip8CheckIdle(const Chip8System *Chip8) {
+    int PC = Chip8->PC;
+    if (PC > 4094) {
+        return CHIP8_IDLE_NONE;
+    }
+    const uint8_t *Memory = Chip8->Chip8Memory;
+    uint16_t Opcode = Memory[PC] << 8 | Memory[PC + 1];
+
+    if (Opcode == (0x1000 | PC)) {
+        return CHIP8_IDLE_HALT;
+    }
+    if ((Opcode & 0xF0FF) == 0xF00A) {
+        return Chip8->Chip8KeyPad != 0 ? CHIP8_IDLE_NONE : CHIP8_IDLE_KEY;
+    }
+    return Chip8DelayPoll(Chip8) >= 0 ? CHIP8_IDLE_DELAY : CHIP8_IDLE_NONE;
+}
+
+//Finds an Fx07 / 3xkk / 1nnn loop polling the delay timer around PC, a slice can end on any of the three instructions.
+//Returns the kk it waits for, or -1 if PC isn't in one or it leaves the loop on this pass.
+int Chip8DelayPoll(const Chip8System *Chip8) {
+    int PC = Chip8->PC;
+    const uint8_t *Memory = Chip8->Chip8Memory;
+    for (int Start = PC - 4; Start <= PC; Start += 2) {
+        if (Start < 0 || Start > 4090) {
+            continue;
+        }
+        uint16_t Load = Memory[Start] << 8 | Memory[Start + 1];
+        uint16_t Skip = Memory[Start + 2] << 8 | Memory[Start + 3];
+        uint16_t Jump = Memory[Start + 4] << 8 | Memory[Start + 5];
+        uint8_t x = (Load & 0x0F00) >> 8;
+        if ((Load & 0xF0FF) != 0xF007 || (Skip & 0xFF00) != (0x3000 | x << 8) || Jump != (0x1000 | Start)) {
+            continue;
+        }
+        uint8_t kk = Skip & 0x00FF;
+        if (Chip8DelayTimer(Chip8) == kk || (PC == Start + 2 && Chip8->V[x] == kk)) {
+            return -1; //Leaves the loop on this pass
+        }
+        return kk;
+    }
+    return -1;
+}
+
+//Runs up to MaxCycles instructions in one call and returns why it stopped, one of the CHIP8_EXIT values.
+//It stops right after a draw, the sound starting, an Fx0A with no key down, or reaching a breakpoint,
+//and also once the ROM is sitting in an idle loop (checked every CHIP8_IDLE_CHECK instructions), which Chip8->Idle describes.
+//Chip8->CyclesRun is the number of instructions that ran.
+int Chip8Run(Chip8System *Chip8, int MaxCycles) {
+    Chip8->CyclesRun = 0;
+    while (Chip8->CyclesRun < MaxCycles) {
+        Chip8->Idle = Chip8CheckIdle(Chip8);
+        if (Chip8->Idle != CHIP8_IDLE_NONE) {
+            return Chip8->Idle == CHIP8_IDLE_KEY ? CHIP8_EXIT_KEYWAIT : CHIP8_EXIT_IDLE;
+        }
+
+        int Slice = MaxCycles - Chip8->CyclesRun < CHIP8_IDLE_CHECK ? MaxCycles - Chip8->CyclesRun : CHIP8_IDLE_CHECK;
+        Chip8->CyclesRun += Chip8->BreakpointCount > 0 ? Chip8RunDebug(Chip8, Slice) : Chip8RunCore(Chip8, Slice);
+        if (Chip8->ExitReason != CHIP8_EXIT_BUDGET) {
+            return Chip8->ExitReason;
+        }
+    }
+    Chip8->Idle = Chip8CheckIdle(Chip8);
+    return CHIP8_EXIT_BUDGET;
+}
+
+//Skips an idle loop without running it, for runs that don't have to keep real time.
+//Works out how many 60 hz ticks the loop lasts and moves the timers past them in one step, at most MaxFrames, and returns the number of ticks skipped.
+//A delay poll ends on the tick the timer reaches kk, and never if it is already below it.
+//Only a key press ends a jump to itself or an Fx0A wait, so those always skip MaxFrames ticks.
+int Chip8FastForward(Chip8System *Chip8, int MaxFrames) {
+    int Frames = 0;
+    int Idle = Chip8CheckIdle(Chip8);
+    if (Idle != CHIP8_IDLE_NONE) {
+        int kk = Idle == CHIP8_IDLE_DELAY ? Chip8DelayPoll(Chip8) : -1;
+        int Delay = Chip8DelayTimer(Chip8);
+        Frames = kk >= 0 && Delay > kk && Delay - kk < MaxFrames ? Delay - kk : MaxFrames;
+    }
+    Chip8->Ticks += Frames;
+    Chip8->Idle = Chip8CheckIdle(Chip8);
+    return Frames;
+}
+
+//Save States
+//A state is everything the ROM can see, copied into a Chip8State with a few memcpys and written to disk in one piece.
+//Fills State from the system.
+void Chip8SaveState(const Chip8System *Chip8, Chip8State *State) {
+    State->Magic = CHIP8_STATE_MAGIC;
+    State->Version = CHIP8_STATE_VERSION;
+    memcpy(State->Display, Chip8->Chip8Display, sizeof(State->Display));
+    memcpy(State->Memory, Chip8->Chip8Memory, sizeof(State->Memory));
+    memcpy(State->Stack, Chip8->Stack, sizeof(State->Stack));
+    State->I = Chip8->I;
+    State->PC = Chip8->PC;
+    State->SP = Chip8->SP;
+    State->KeyPad = Chip8->Chip8KeyPad;
+    State->Rng = Chip8->Rng;
+    memcpy(State->V, Chip8->V, sizeof(State->V));
+    State->DelayTimer = Chip8DelayTimer(Chip8);
+    State->SoundTimer = Chip8SoundTimer(Chip8);
+    State->Quirks = (uint8_t)Chip8->Quirks;
+    State->Reserved = 0;
+}
+
+//Puts the system back to State, false (leaving the system alone) if State isn't a save state this version can read.
+//Only the code that changed is invalidated, so blocks the JIT, the translator or Chip8-AOT made for the same ROM stay usable.
+bool Chip8LoadState(Chip8System *Chip8, const Chip8State *State) {
+    //A state only loads into the build and quirk profile that saved it, and a damaged file can't point I, PC or SP outside memory or the stack.
+    if (State->Magic != CHIP8_STATE_MAGIC || State->Version != CHIP8_STATE_VERSION || State->Quirks != Chip8->Quirks || State->SP > 15) {
+        return false;
+    }
+    //256 byte pages that didn't change are skipped with one memcmp, the others are compared 8 bytes at a time.
+    for (int Page = 0; Page < 4096; Page += 256) {
+        if (memcmp(Chip8->Chip8Memory + Page, State->Memory + Page, 256) == 0) {
+            continue;
+        }
+        for (int a = Page; a < Page + 256; a += 8) {
+            if (memcmp(Chip8->Chip8Memory + a, State->Memory + a, 8) == 0) {
+                continue;
+            }
+            int End = a + 8;
+            while (End < Page + 256 && memcmp(Chip8->Chip8Memory + End, State->Memory + End, 8) != 0) {
+                End += 8;
+            }
+            memcpy(Chip8->Chip8Memory + a, State->Memory + a, End - a);
+            Chip8InvalidateCode(Chip8, (uint16_t)a, End - a);
+            a = End;
+        }
+    }
+
+    memcpy(Chip8->Chip8Display, State->Display, sizeof(State->Display));
+    memcpy(Chip8->Stack, State->Stack, sizeof(State->Stack));
+    Chip8->I = State->I & 0xFFF;
+    Chip8->PC = State->PC & 0xFFF;
+    Chip8->SP = State->SP;
+    Chip8->Chip8KeyPad = State->KeyPad;
+    Chip8->Rng = State->Rng;
+    memcpy(Chip8->V, State->V, sizeof(State->V));
+    Chip8SetDelayTimer(Chip8, State->DelayTimer);
+    Chip8->SoundExpiry = Chip8->Ticks + State->SoundTimer;
+
+    Chip8->DisplayUpdate = 1;
+    Chip8->DirtyRows = 0xFFFFFFFF;
+    Chip8->Idle = Chip8CheckIdle(Chip8);
+    return true;
+}
+
+//Writes the state to a temporary file first, so a crash part way through never leaves a broken state behind.
+bool Chip8SaveStateFile(const Chip8System *Chip8, const std::string &Path) {
+    Chip8State State;
+    Chip8SaveState(Chip8, &State);
+    std::string Temp = Path + ".tmp";
+    std::ofstream File(Temp, std::ios::binary);
+    if (!File.write(reinterpret_cast<const char*>(&State), sizeof(State))) {
+        return false;
+    }
+    File.close();
+    if (std::rename(Temp.c_str(), Path.c_str()) != 0) {
+        //Windows won't rename over a file that exists.
+        std::remove(Path.c_str());
+        return std::rename(Temp.c_str(), Path.c_str()) == 0;
+    }
+    return true;
+}
+
+bool Chip8LoadStateFile(Chip8System *Chip8, const std::string &Path) {
+    Chip8State State;
+    std::ifstream File(Path, std::ios::binary);
+    if (!File.read(reinterpret_cast<char*>(&State), sizeof(State))) {
+        return false;
+    }
+    return Chip8LoadState(Chip8, &State);
+}
+
+//Saves or loads one of the slot files, on the thread that owns the system.
+void Chip8StateSlot(Chip8System *Chip8, int Slot, bool Save) {
+    if (Slot < 0 || Slot >= CHIP8_STATE_SLOTS) {
+        return;
+    }
+    std::string Path = Chip8->StateName + ".state" + std::to_string(Slot);
+    if (Save) {
+        std::cout << (Chip8SaveStateFile(Chip8, Path) ? "Saved the state to " : "Unable to save the state to ") << Path << "." << std::endl;
+        return;
+    }
+
+    bool Sound = Chip8SoundTimer(Chip8) > 0;
+    if (!Chip8LoadStateFile(Chip8, Path)) {
+        std::cout << "No save state in " << Path << " this version and quirk profile can load." << std::endl;
+        return;
+    }
+    std::cout << "Loaded the state from " << Path << "." << std::endl;
+    //The tone may have to start or stop with the new state.
+    if (Chip8->Shared != nullptr && (Chip8SoundTimer(Chip8) > 0) != Sound) {
+        Chip8PushAudioEvent(Chip8->Shared, Chip8->AudioClock, !Sound);
+    }
+}
+
+#ifdef CHIP8_BENCHMARK
+//Decoder Benchmark, built with "make bench".
+//Runs the same program through every CPU core and prints instructions per second for each.
+//Pass a ROM file to benchmark it, otherwise a small built in loop of math, skip, call and draw opcodes is used.
+static double Chip8BenchmarkCore(const Chip8System &Start, void (*Core)(Chip8System *Chip8, uint16_t opcode), long long Cycles) {
+    Chip8System *Chip8 = new Chip8System(Start);
+
+    auto Begin = std::chrono::steady_clock::now();
+    for (long long c = 0; c < Cycles; c++) {
+        //Masked the same way Chip8Step does, so a ROM that runs off the end of memory wraps instead of reading past it.
+        Chip8->PC &= 0xFFF;
+        uint16_t Opcode = Chip8->Chip8Memory[Chip8->PC] << 8 | Chip8->Chip8Memory[(Chip8->PC + 1) & 0xFFF];
+        Core(Chip8, Opcode);
+        Chip8->PC += 2;
+    }
+    auto End = std::chrono::steady_clock::now();
+
+    delete Chip8;
+    return Cycles / std::chrono::duration<double>(End - Begin).count();
+}
+
+//Same as above for cores that run a whole slice of instructions per call.
+static double Chip8BenchmarkSlices(const Chip8System &Start, int (*Core)(Chip8System *Chip8, int Cycles), long long Cycles) {
+    Chip8System *Chip8 = new Chip8System(Start);
+
+    auto Begin = std::chrono::steady_clock::now();
+    for (long long c = 0; c < Cycles; ) {
+        c += Core(Chip8, 10000); //Draws end a slice early
+    }
+    auto End = std::chrono::steady_clock::now();
+
+    Chip8FreeJit(Chip8);
+    delete Chip8;
+    return Cycles / std::chrono::duration<double>(End - Begin).count();
+}
+
+static int Chip8BenchmarkJit(Chip8System *Chip8, int Cycles) {
+    return Chip8RunJit(Chip8, Cycles, false);
+}
+
+int Chip8Benchmark(int argc, char *argv[]) {
+    const uint8_t BenchProgram[] = {
+        0x60, 0x00, //0x200: LD V0, 0
+        0x61, 0x01, //0x202: LD V1, 1
+        0x70, 0x01, //0x204: ADD V0, 1
+        0x80, 0x14, //0x206: ADD V0, V1
+        0x82, 0x12, //0x208: AND V2, V1
+        0x30, 0x05, //0x20A: SE V0, 5
+        0xA3, 0x00, //0x20C: LD I, 0x300
+        0xF2, 0x1E, //0x20E: ADD I, V2
+        0x83, 0x06, //0x210: SHR V3
+        0x22, 0x20, //0x212: CALL 0x220
+        0xD0, 0x11, //0x214: DRW V0, V1, 1
+        0x12, 0x04, //0x216: JP 0x204
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x84, 0x23, //0x220: XOR V4, V2
+        0x45, 0x00, //0x222: SNE V5, 0
+        0x75, 0x01, //0x224: ADD V5, 1
+        0x00, 0xEE  //0x226: RET
+    };
+
+    Chip8System *Chip8 = new Chip8System{};
+    for (int f = 80; f < 160; f++) {
+        Chip8->Chip8Memory[f] = Chip8->FONT[f-80];
+    }
+
+    Chip8ResetDecodeCache(Chip8);
+    Chip8FlushBlocks(Chip8);
+
+    if (argc > 1) {
+        std::ifstream file(argv[1], std::ios::binary);
+        if (!file.is_open()) {
+            std::cout << "Unable to open ROM file, exiting...." << std::endl;
+            return EXIT_FAILURE;
+        }
+        file.read(reinterpret_cast<char*>(Chip8->Chip8Memory) + 0x200, 3584);
+        Chip8->Quirks = Chip8QuirksForRom(argv[1]);
+    }
+    else {
+        memcpy(Chip8->Chip8Memory + 0x200, BenchProgram, sizeof(BenchProgram));
+    }
+
+    const long long Cycles = 50000000;
+    std::cout << "Running " << Cycles << " instructions per core..." << std::endl;
+
+    double SwitchIPS = Chip8BenchmarkCore(*Chip8, Chip8CPUSwitch, Cycles);
+    double TableIPS = Chip8BenchmarkCore(*Chip8, Chip8CPU, Cycles);
+    double ThreadedIPS = Chip8BenchmarkSlices(*Chip8, Chip8RunThreaded, Cycles);
+    double CachedIPS = Chip8BenchmarkSlices(*Chip8, Chip8RunCached, Cycles);
+    double BlocksIPS = Chip8BenchmarkSlices(*Chip8, Chip8RunBlocks, Cycles);
+    double JitIPS = Chip8BenchmarkSlices(*Chip8, Chip8BenchmarkJit, Cycles);
+
+    std::cout << "Switch decoder:       " << SwitchIPS / 1000000.0 << " million instructions per second" << std::endl;
+    std::cout << "Table decoder:        " << TableIPS / 1000000.0 << " million instructions per second (" << TableIPS / SwitchIPS << "x)" << std::endl;
+    std::cout << "Threaded interpreter: " << ThreadedIPS / 1000000.0 << " million instructions per second (" << ThreadedIPS / SwitchIPS << "x)" << std::endl;
+    std::cout << "Pre-decoded cache:    " << CachedIPS / 1000000.0 << " million instructions per second (" << CachedIPS / SwitchIPS << "x)" << std::endl;
+    std::cout << "Block translator:     " << BlocksIPS / 1000000.0 << " million instructions per second (" << BlocksIPS / SwitchIPS << "x)" << std::endl;
+    std::cout << "x86-64 JIT:           " << JitIPS / 1000000.0 << " million instructions per second (" << JitIPS / SwitchIPS << "x)" << std::endl;
+
+    delete Chip8;
+    return EXIT_SUCCESS;
+}
+#endif
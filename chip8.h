@@ -0,0 +1,394 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+//Chip-8 system state and the functions that run it.
+//Shared by the emulator and by C++ files generated by the Chip8-AOT recompiler, which run directly on this struct.
+#include <cstdint>
+#include <atomic>
+#include <string>
+#ifndef CHIP8_HEADLESS
+#include <SDL2/SDL.h>
+#endif
+#include "chip8quirks.h"
+
+//CPU Cores, picked at startup
+enum Chip8Core {
+    CHIP8_CORE_TABLE = 0, //Table driven decoder, one handler call per instruction
+    CHIP8_CORE_THREADED = 1, //Computed goto threaded interpreter, needs GCC or Clang
+    CHIP8_CORE_CACHED = 2, //Table handlers run from a cache of pre-decoded instructions
+    CHIP8_CORE_BLOCKS = 3, //Basic blocks translated to micro-op runs, with chaining between blocks
+    CHIP8_CORE_JIT = 4, //Basic blocks compiled to x86-64 code, falls back to the block translator on other hosts
+    CHIP8_CORE_JIT_VERIFY = 5, //The JIT, with every compiled block checked against the interpreter
+    CHIP8_CORE_AOT = 6 //Native code made ahead of time by Chip8-AOT, only in builds made with "make aot"
+};
+
+//Ways to draw the display, picked with --renderer
+enum Chip8Renderer {
+    CHIP8_RENDER_TEXTURE = 0, //Streaming texture on the default renderer
+    CHIP8_RENDER_RECTS = 1, //One rectangle per lit pixel, for renderers without streaming textures
+    CHIP8_RENDER_SOFTWARE = 2 //Streaming texture on SDL's software renderer
+};
+
+//Idle loops, see Chip8CheckIdle
+enum Chip8Idle {
+    CHIP8_IDLE_NONE = 0,
+    CHIP8_IDLE_HALT = 1, //1nnn jumping to itself
+    CHIP8_IDLE_DELAY = 2, //Fx07 / 3xkk / 1nnn polling the delay timer
+    CHIP8_IDLE_KEY = 3 //Fx0A waiting for a key
+};
+
+//Why Chip8Run returned
+enum Chip8Exit {
+    CHIP8_EXIT_BUDGET = 0, //Ran all the instructions it was given
+    CHIP8_EXIT_DRAW = 1, //00E0 or Dxyn changed the display
+    CHIP8_EXIT_SOUND = 2, //Fx18 started or stopped the sound
+    CHIP8_EXIT_KEYWAIT = 3, //Fx0A is waiting for a key
+    CHIP8_EXIT_BREAKPOINT = 4, //PC reached a breakpoint
+    CHIP8_EXIT_IDLE = 5 //Sitting in an idle loop until the next timer tick, see Chip8->Idle
+};
+
+//Set in Chip8Shared::Latest while the buffer it names hasn't been taken by the main thread.
+#define CHIP8_FRAME_FRESH 4
+
+//Size of the audio event ring, a power of two so the indices can wrap freely.
+#define CHIP8_AUDIO_EVENTS 64
+//Frames the audio callback's clock trails the emulator by.
+#define CHIP8_AUDIO_LAG 3
+//Frames the emulator may fall behind the audio clock before it skips ahead instead of catching up, see Chip8WaitAudio.
+#define CHIP8_AUDIO_MAX_BEHIND 30
+
+//Tone on or off, at a guest cycle, see Chip8PushAudioEvent
+struct Chip8AudioEvent {
+    uint64_t Cycle;
+    bool On;
+};
+
+//Key presses kept for the input latency report.
+#define CHIP8_LATENCY_SAMPLES 1024
+
+//Chip8Now timestamps following one key press through the emulator, 0 for stages not reached yet, see Chip8TrackLatency.
+struct Chip8LatencyProbe {
+    uint64_t Key; //Key event reached the main thread
+    uint64_t Poll; //The ROM first read the keypad after it
+    uint64_t Draw; //First draw after that read
+};
+
+//Latency of the last CHIP8_LATENCY_SAMPLES key presses in ms, Count keeps going up so Count % CHIP8_LATENCY_SAMPLES is the oldest entry.
+struct Chip8LatencyStats {
+    float Poll[CHIP8_LATENCY_SAMPLES], Draw[CHIP8_LATENCY_SAMPLES], Present[CHIP8_LATENCY_SAMPLES];
+    int Count = 0;
+};
+
+//Frames kept for the frame pacing report.
+#define CHIP8_PACE_SAMPLES 4096
+//Length of a 60 hz frame, in Chip8Now's nanoseconds.
+#define CHIP8_FRAME_NS (1000000000 / 60)
+
+//How late the emulation thread started each of the last CHIP8_PACE_SAMPLES frames in ms, see Chip8WaitFrame.
+struct Chip8PaceStats {
+    float Late[CHIP8_PACE_SAMPLES];
+    uint64_t Count = 0;
+};
+
+//Save state file format, see Chip8SaveState. Bump the version whenever Chip8State changes.
+#define CHIP8_STATE_MAGIC 0x53533843 //"C8SS" in a little endian file
+#define CHIP8_STATE_VERSION 1
+//Save state slots on F1 to F9, slot 0 is the one --resume uses.
+#define CHIP8_STATE_SLOTS 10
+
+//Everything a ROM can see, in a fixed layout with no padding, written to and read from files as is (in host byte order).
+//Timers are stored as the values they read, so a state loads into a session whose tick count is different.
+struct Chip8State {
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t Display[32];
+    uint8_t Memory[4096];
+    uint16_t Stack[16];
+    uint16_t I, PC, SP, KeyPad;
+    uint32_t Rng;
+    uint8_t V[16];
+    uint8_t DelayTimer, SoundTimer, Quirks, Reserved;
+};
+static_assert(sizeof(Chip8State) == 4424, "Chip8State has to keep its layout, bump CHIP8_STATE_VERSION if it changes");
+
+//State the main thread and the emulation thread share, everything in Chip8System belongs to the emulation thread once it starts.
+//Kept out of Chip8System so the system can still be copied.
+struct Chip8Shared {
+    std::atomic<bool> Running{true}; //Cleared by the main thread to stop the emulation thread
+    std::atomic<uint16_t> KeyMask{0}; //Bit k is set while Chip-8 key k is held
+    std::atomic<uint64_t> KeyTime{0}; //When the last key went down, written before KeyMask
+    std::atomic<int> StateRequest{0}; //Save state slot to save (1 to 9) or load (-1 to -9) before the next frame, 0 for none
+
+    //Sound events from the emulation thread to the audio callback
+    Chip8AudioEvent AudioEvents[CHIP8_AUDIO_EVENTS];
+    std::atomic<uint32_t> AudioHead{0}; //Written by the emulation thread
+    std::atomic<uint32_t> AudioTail{0}; //Written by the audio callback
+    std::atomic<uint64_t> AudioClock{0}; //Guest cycles at the end of the last frame the emulation thread finished
+    int ClockHz = 0, SampleRate = 0; //Guest cycles and samples per second, both 0 without an audio device
+    std::atomic<uint64_t> SamplesPlayed{0}; //Samples the callback has handed to the device, the master clock with AudioSync
+
+    //Audio thread only, see Chip8AudioCallback
+    uint64_t AudioPos = 0; //Guest time of the next sample, in cycles times SampleRate
+    bool Tone = false;
+    uint32_t Phase = 0, PhaseStep = 0;
+    int16_t Amplitude = 0;
+
+    //Triple buffer, see Chip8PublishFrame
+    uint64_t Frames[3][32] = {};
+    Chip8LatencyProbe FrameProbes[3] = {}; //Latency probe finished by each frame, if any
+    std::atomic<uint8_t> Latest{0}; //Buffer published last, with CHIP8_FRAME_FRESH set until it is taken
+    uint8_t Back = 1; //Emulation thread only, buffer the next frame is written to
+    uint8_t Front = 2; //Main thread only, buffer on screen
+
+    //Main thread only, the frame on screen, so only rows that differ are uploaded
+    uint64_t Shown[32] = {};
+    bool ShownValid = false; //Cleared when the window has to be redrawn in full
+    Chip8LatencyStats Latency;
+
+    //Emulation thread only, the main thread reads it after the thread has stopped
+    Chip8PaceStats Pacing;
+};
+
+//Instructions run between idle loop checks.
+#define CHIP8_IDLE_CHECK 256
+
+struct Chip8System;
+struct Chip8Decoded;
+struct Chip8Jit;
+typedef void (*Chip8OpHandler)(Chip8System *Chip8, uint16_t Opcode);
+
+//A decoded instruction, the handler to run and the opcode it pulls its operands out of.
+struct Chip8Decoded {
+    Chip8OpHandler Handler;
+    uint16_t Opcode;
+};
+
+//A translated basic block, its micro-ops live in Chip8System::BlockOps.
+struct Chip8Block {
+    uint16_t Start, End; //Guest addresses covered, End is one past the last instruction
+    uint16_t First, Count; //Micro-ops in BlockOps
+    int16_t Next; //Block at the 1nnn/2nnn target once it has been looked up, -1 if not chained
+    uint8_t Chainable; //Block ends in 1nnn or 2nnn, so its successor never changes
+};
+
+//A block compiled ahead of time by Chip8-AOT.
+struct Chip8AOTBlock {
+    uint16_t Start, End, Count; //Guest addresses covered and the number of instructions
+    void (*Run)(Chip8System *Chip8);
+};
+
+//Chip 8 System Struct
+struct Chip8System {
+    //Memory (The Chip-8 has 4 Kb, or 4096 bytes)
+    uint8_t Chip8Memory[4096];
+
+    //Program Counter and Index Register Initilization
+    uint16_t I = 0; //The PC and Index Register can actually only address 12 bits
+    uint16_t PC = 0x200; //First location of memory allocated for Chip8 should be loaded into x200.
+    uint16_t SP = 15; //Defaults to top of the stack
+
+    //Register Initilization (V0-VF)
+    uint8_t V[16]; //Its better to use this an array rather than a bunch of variables since it is easier to manage.
+
+    //Timers, kept as the tick each one reaches 0 on and worked out only when read, see Chip8DelayTimer.
+    uint64_t Ticks = 0; //60 hz timer ticks so far
+    uint64_t DelayExpiry = 0, SoundExpiry = 0;
+
+    //Stack
+    uint16_t Stack[16]; //Limited Stack Space
+
+    //Display
+    uint64_t Chip8Display[32]; //One bit per pixel, one 64 pixel row per word with the leftmost pixel in bit 63.
+    uint8_t DisplayUpdate = 0; //The flag only needs to be on or off, so it is better to use the smallest variable possible.
+    uint32_t DirtyRows = 0; //Bit y is set when row y was drawn to or cleared since the last published frame
+    uint64_t ShownDisplay[32]; //Copy of the last frame published, frames that match it aren't handed over again.
+    uint8_t ShownValid = 0; //Cleared until the first frame has been published
+
+    //Keypad State; Each Key is either on or off, bit k is set while key k is held.
+    uint16_t Chip8KeyPad = 0;
+#ifndef CHIP8_HEADLESS
+    SDL_Scancode keymap[16] = { 
+    //Keymap for the Chip-8 system, indexed by Chip-8 key. The host keys form the same 4x4 block as the original keypad:
+    //1 2 3 C    1 2 3 4
+    //4 5 6 D    Q W E R
+    //7 8 9 E    A S D F
+    //A 0 B F    Z X C V
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3, //Key Presses 0, 1, 2, 3
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A, //Key Presses 4, 5, 6, 7
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C, //Key Presses 8, 9, A, B
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V  //Key Presses C, D, E, F
+}; 
+    int8_t KeyLookup[SDL_NUM_SCANCODES]; //Chip-8 key for each scancode, -1 for keys that aren't mapped, see Chip8BuildKeyLookup
+#endif
+    uint8_t KeyPolled = 0; //Set by Ex9E, ExA1 and Fx0A, for the input latency probe
+    Chip8LatencyProbe Probe = {}; //Key press being followed, see Chip8TrackLatency
+
+    //Font, will be loaded into memory locations 0x050 to 0x09F
+    uint8_t FONT[80] {
+    0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+    0x20, 0x60, 0x20, 0x20, 0x70, // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+    };
+
+    //Display Variables
+    int WIDTH = 64, HEIGHT = 32, scalefactor;
+    uint32_t OnColor = 0xFFFFFF, OffColor = 0x000000; //RRGGBB
+    int Renderer = CHIP8_RENDER_TEXTURE;
+#ifndef CHIP8_HEADLESS
+    SDL_Texture *Texture = nullptr; //Streaming texture the display is uploaded to, nullptr to draw with rectangles
+#endif
+    bool Headless = false; //Run with no window, sound or pacing, see Chip8RunHeadless
+    const char *PaceLog = nullptr; //File the frame pacing report is written to, nullptr for none
+    Chip8Shared *Shared = nullptr; //Key mask and frame handoff shared with the main thread
+
+    //Sound Variables
+    int ToneHz = 1030; //Pitch of the square wave played while the sound timer runs
+    int Volume = 25; //Percent of full scale
+    uint64_t AudioClock = 0; //Guest time in cycles at the start of this frame, every frame counts its full budget whether the ROM ran it or not
+
+    //Scheduler Variables
+    int IPS = 700; //Instructions per second, 0 lets the CPU run as fast as the host allows.
+    int CycleBudget = 0; //Leftover instructions (times 60) carried between frames, so IPS values that don't divide by 60 stay accurate.
+    int CPUCore = CHIP8_CORE_TABLE; //The other cores are opt in with --core, compare them on a ROM with "make bench"
+    int AudioSync = 0; //1 to pace frames by the audio device's clock instead of the system timer
+    uint64_t Frames = 0, Cycles = 0; //Frames and instructions run so far
+
+    //Exit conditions from the command line, see Chip8StopCondition
+    uint64_t MaxFrames = 0, MaxCycles = 0; //0 for no limit
+    bool ExitOnHalt = false, ExitOnKeyWait = false;
+    int Idle = CHIP8_IDLE_NONE; //Idle loop the last slice stopped in
+    int Quirks = CHIP8_QUIRKS_VIP; //Quirk profile, picked for each ROM when it is loaded
+
+    //Random number state for Cxkk, see Chip8Random
+    uint32_t Rng = 0x9E3779B9;
+
+    //Save states, see Chip8StateSlot
+    std::string StateName; //Slot files are StateName.state0 to StateName.state9, StateName being the ROM's file name
+    bool Resume = false; //Load slot 0 at startup and save it on exit
+
+    //Chip8Run State
+    int ExitReason = CHIP8_EXIT_BUDGET; //Set by the instruction that ends a slice early
+    int CyclesRun = 0; //Instructions the last Chip8Run executed
+    uint8_t Breakpoints[4096] = {}; //1 at each address Chip8Run stops at
+    int BreakpointCount = 0;
+
+    //Pre-decoded instruction cache, one entry per even address (0x000, 0x002, ... 0xFFE).
+    //Entries that were never decoded, or whose memory was written since, run Chip8OpDecodeMiss instead.
+    Chip8Decoded DecodeCache[2048];
+
+    //Basic block cache, see Chip8RunBlocks.
+    int16_t BlockMap[4096]; //Block starting at each address, -1 if none
+    uint8_t CodeMap[4096]; //1 if any block was translated from this byte, so writes to data never have to search the blocks
+    Chip8Block Blocks[1024];
+    Chip8Decoded BlockOps[4096];
+    int BlockCount = 0, BlockOpCount = 0, BlockGeneration = 0; //BlockGeneration changes on every flush, so stale block indexes can be spotted
+
+    //Compiled code for the JIT core, created the first time it runs.
+    Chip8Jit *Jit = nullptr;
+
+    //Ahead of time compiled block starting at each address, -1 if there is none or the guest has written over it.
+    int16_t AOTMap[4096];
+};
+
+//Timer values from their expiry ticks, a timer set to n at tick t reads n - (Ticks - t) until it reaches 0.
+//Nothing has to count them down, a tick only moves Ticks on.
+inline uint8_t Chip8DelayTimer(const Chip8System *Chip8) {
+    return Chip8->DelayExpiry > Chip8->Ticks ? (uint8_t)(Chip8->DelayExpiry - Chip8->Ticks) : 0;
+}
+
+inline uint8_t Chip8SoundTimer(const Chip8System *Chip8) {
+    return Chip8->SoundExpiry > Chip8->Ticks ? (uint8_t)(Chip8->SoundExpiry - Chip8->Ticks) : 0;
+}
+
+inline void Chip8SetDelayTimer(Chip8System *Chip8, uint8_t Value) {
+    Chip8->DelayExpiry = Chip8->Ticks + Value;
+}
+
+//Cxkk's random numbers, xorshift32 on state kept in the system, so save states and headless runs repeat exactly.
+inline uint8_t Chip8Random(Chip8System *Chip8) {
+    uint32_t x = Chip8->Rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    Chip8->Rng = x;
+    return (uint8_t)(x >> 24);
+}
+
+//System Function Declarations
+//The SDL frontend, left out of headless builds (-DCHIP8_HEADLESS), which don't need SDL at all.
+#ifndef CHIP8_HEADLESS
+void Chip8DisplayInit(Chip8System *Chip8, SDL_Renderer *renderer);
+void Chip8DisplayOut(Chip8System *Chip8, SDL_Renderer *renderer, const uint64_t *Frame, uint32_t Rows);
+int Chip8EmulationThread(void *Data);
+void Chip8WaitFrame(uint64_t *NextFrame, Chip8PaceStats *Pacing);
+void Chip8WaitAudio(Chip8Shared *Shared, uint64_t *Frames);
+void Chip8TrackLatency(Chip8System *Chip8, int Reason);
+void Chip8RecordLatency(Chip8Shared *Shared, Chip8LatencyProbe *Probe, uint64_t Presented);
+void Chip8ReportLatency(const Chip8Shared *Shared);
+void Chip8ReportPacing(const Chip8Shared *Shared, const char *Path);
+SDL_AudioDeviceID Chip8AudioInit(Chip8System *Chip8);
+void Chip8Keyboard(Chip8System *Chip8);
+void Chip8BuildKeyLookup(Chip8System *Chip8);
+bool Chip8LoadKeymap(Chip8System *Chip8, const std::string &Path);
+uint32_t Chip8ChangedRows(Chip8System *Chip8);
+#endif
+int Chip8RunHeadless(Chip8System *Chip8);
+uint64_t Chip8Now();
+void Chip8SleepUntil(uint64_t Deadline, bool Spin);
+uint64_t Chip8DisplayHash(const Chip8System *Chip8);
+void Chip8PublishFrame(Chip8Shared *Shared, const uint64_t *Display, Chip8LatencyProbe *Probe);
+bool Chip8TakeFrame(Chip8Shared *Shared);
+void Chip8Init(Chip8System *Chip8, int argc, char *argv[]);
+const char *Chip8StopCondition(const Chip8System *Chip8, int Reason);
+void Chip8CPU(Chip8System *Chip8, uint16_t opcode);
+#ifdef CHIP8_BENCHMARK
+void Chip8CPUSwitch(Chip8System *Chip8, uint16_t opcode);
+#endif
+void Chip8UpdateTimers(Chip8System *Chip8);
+void Chip8PushAudioEvent(Chip8Shared *Shared, uint64_t Cycle, bool On);
+void Chip8Step(Chip8System *Chip8);
+int Chip8RunThreaded(Chip8System *Chip8, int Cycles);
+int Chip8Run(Chip8System *Chip8, int MaxCycles);
+void Chip8SetBreakpoint(Chip8System *Chip8, uint16_t Address, bool Enabled);
+void Chip8SetSoundTimer(Chip8System *Chip8, uint8_t Value);
+int Chip8RunCached(Chip8System *Chip8, int Cycles);
+void Chip8ResetDecodeCache(Chip8System *Chip8);
+int Chip8RunBlocks(Chip8System *Chip8, int Cycles);
+void Chip8FlushBlocks(Chip8System *Chip8);
+int Chip8RunJit(Chip8System *Chip8, int Cycles, bool Verify);
+void Chip8FreeJit(Chip8System *Chip8);
+void Chip8ClearDisplay(Chip8System *Chip8);
+uint8_t Chip8DrawSprite(Chip8System *Chip8, uint8_t Spritex, uint8_t Spritey, uint16_t Address, uint8_t Height, bool Wrap);
+void Chip8InvalidateCode(Chip8System *Chip8, uint16_t Address, int Length);
+int Chip8RunAOT(Chip8System *Chip8, int Cycles);
+void Chip8LoadAOT(Chip8System *Chip8);
+int Chip8CheckIdle(const Chip8System *Chip8);
+int Chip8DelayPoll(const Chip8System *Chip8);
+int Chip8FastForward(Chip8System *Chip8, int MaxFrames);
+void Chip8SaveState(const Chip8System *Chip8, Chip8State *State);
+bool Chip8LoadState(Chip8System *Chip8, const Chip8State *State);
+bool Chip8SaveStateFile(const Chip8System *Chip8, const std::string &Path);
+bool Chip8LoadStateFile(Chip8System *Chip8, const std::string &Path);
+void Chip8StateSlot(Chip8System *Chip8, int Slot, bool Save);
+
+//Defined by the file Chip8-AOT generates, only linked in with -DCHIP8_AOT.
+extern const Chip8AOTBlock Chip8AOTBlocks[];
+extern const int Chip8AOTBlockCount;
+extern const uint8_t Chip8AOTRom[];
+extern const int Chip8AOTRomSize;
+extern const int Chip8AOTQuirks;
+
+#endif
@@ -0,0 +1,287 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <cstdint>
+#include <cstdio>
+#include "chip8quirks.h"
+
+//Chip-8 Ahead of Time Recompiler
+//Usage: Chip8-AOT game.ch8 game_aot.cpp [vip|chip48|schip|xochip]
+//Follows the ROM's control flow from 0x200 through jumps, calls, returns and skips, splits it into basic blocks,
+//and writes one C++ function per block that works directly on Chip8System (see chip8.h).
+//Build the emulator with the generated file and -DCHIP8_AOT ("make aot ROM=game.ch8") and pick the AOT core.
+//Bnnn jumps can't be followed, and Fx0A is left to the interpreter, so the emulator steps the interpreter wherever there is no block.
+//Blocks the guest writes over are dropped at run time and that code runs on the interpreter from then on.
+//The code is made for one quirk profile, picked from the ROM's extension like the emulator does unless one is given.
+
+//Longest block the recompiler will make, the emulator never looks further back than this when code is overwritten.
+//A block only runs if it fits in what's left of the emulator's slice, which is 11 or 12 instructions at 700 IPS.
+const int MaxBlockLength = 8;
+
+struct AOTBlock {
+    uint16_t Start, End, Count;
+};
+
+static uint8_t Memory[4096];
+static Chip8Quirks Quirks;
+
+static uint16_t Fetch(uint16_t Address) {
+    return Memory[Address] << 8 | Memory[Address + 1];
+}
+
+//Opcodes the recompiler leaves to the interpreter, the block stops right before them.
+static bool Interpreted(uint16_t opcode) {
+    return (opcode & 0xF0FF) == 0xF00A; //Fx0A waits on the keypad, the frontend has to run between tries
+}
+
+//Opcodes that change PC, write memory that may hold code, or end Chip8Run (draws and Fx18) end a block.
+static bool EndsBlock(uint16_t opcode) {
+    switch (opcode & 0xF000) {
+        case 0x0000: return (opcode & 0x00FF) == 0x00EE || (opcode & 0x00FF) == 0x00E0;
+        case 0x1000: case 0x2000: case 0x3000: case 0x4000: case 0x5000: case 0x9000: case 0xB000: case 0xD000: return true;
+        case 0xE000: return (opcode & 0x00FF) == 0x009E || (opcode & 0x00FF) == 0x00A1;
+        case 0xF000: return (opcode & 0x00FF) == 0x0018 || (opcode & 0x00FF) == 0x0033 || (opcode & 0x00FF) == 0x0055;
+    }
+    return false;
+}
+
+//Guest addresses this block can continue at, when they are known ahead of time.
+static void Successors(uint16_t opcode, uint16_t Address, std::vector<uint16_t> &Out) {
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if ((opcode & 0x00FF) != 0x00EE) Out.push_back(Address + 2); //Returns go back to the address after a call, which the call already queued
+            return;
+        case 0x1000:
+            Out.push_back(opcode & 0x0FFF);
+            return;
+        case 0x2000:
+            Out.push_back(opcode & 0x0FFF);
+            Out.push_back(Address + 2);
+            return;
+        case 0x3000: case 0x4000: case 0x5000: case 0x9000: case 0xE000:
+            Out.push_back(Address + 2);
+            Out.push_back(Address + 4);
+            return;
+        case 0xB000: //Computed jump, left to the interpreter
+            return;
+    }
+    Out.push_back(Address + 2);
+}
+
+//Local name for a V register, V0 to VF are copied into locals for the whole block so the compiler can keep them in host registers.
+static std::string Reg(int r) {
+    char Name[4];
+    snprintf(Name, sizeof(Name), "V%X", r);
+    return Name;
+}
+
+static std::string Hex(int Value) {
+    char Text[8];
+    snprintf(Text, sizeof(Text), "0x%03X", Value);
+    return Text;
+}
+
+//C++ for one opcode. Terminators set NextPC instead of falling through.
+//The semantics are the same as the table handlers in chip8.cpp, including the order VF is written in.
+static std::string Translate(uint16_t opcode, uint16_t Address, std::string &NextPC) {
+    int x = (opcode & 0x0F00) >> 8, y = (opcode & 0x00F0) >> 4, n = opcode & 0x000F, kk = opcode & 0x00FF, nnn = opcode & 0x0FFF;
+    std::string Vx = Reg(x), Vy = Reg(y), VF = Reg(15);
+    std::string Shifted = Quirks.ShiftVy ? Vy : Vx;
+    std::string LoadStoreI = Quirks.LoadStoreI == 0 ? "" : "I = (I + " + std::to_string(x + Quirks.LoadStoreI - 1) + ") & 0xFFF;";
+    std::string Skip = Hex(Address + 4) + " : " + Hex(Address + 2) + ";";
+
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (kk == 0xE0) return "Chip8ClearDisplay(Chip8);";
+            if (kk == 0xEE) { NextPC = "Chip8->Stack[Chip8->SP++] + 2;"; return ""; }
+            return "";
+        case 0x1000: NextPC = Hex(nnn) + ";"; return "";
+        case 0x2000: NextPC = Hex(nnn) + ";"; return "Chip8->SP--; Chip8->Stack[Chip8->SP] = " + Hex(Address) + ";";
+        case 0x3000: NextPC = Vx + " == " + Hex(kk) + " ? " + Skip; return "";
+        case 0x4000: NextPC = Vx + " != " + Hex(kk) + " ? " + Skip; return "";
+        case 0x5000: NextPC = x == y ? Hex(Address + 4) + ";" : Vx + " == " + Vy + " ? " + Skip; return ""; //A register compared with itself would be a warning in the generated code
+        case 0x9000: NextPC = x == y ? Hex(Address + 2) + ";" : Vx + " != " + Vy + " ? " + Skip; return "";
+        case 0x6000: return Vx + " = " + Hex(kk) + ";";
+        case 0x7000: return Vx + " += " + Hex(kk) + ";";
+        case 0x8000:
+            switch (n) {
+                case 0x0: return Vx + " = " + Vy + ";";
+                case 0x1: return Vx + " |= " + Vy + ";" + (Quirks.ResetVF ? " " + VF + " = 0;" : "");
+                case 0x2: return Vx + " &= " + Vy + ";" + (Quirks.ResetVF ? " " + VF + " = 0;" : "");
+                case 0x3: return Vx + " ^= " + Vy + ";" + (Quirks.ResetVF ? " " + VF + " = 0;" : "");
+                case 0x4: return "{ uint16_t Sum = " + Vx + " + " + Vy + "; " + VF + " = Sum > 255; " + Vx + " = (uint8_t)Sum; }";
+                case 0x5: return VF + " = " + Vx + " > " + Vy + "; " + Vx + " -= " + Vy + ";";
+                case 0x6: return VF + " = " + Shifted + " & 0x1; " + Vx + " = " + Shifted + " >> 1;";
+                case 0x7: return VF + " = " + Vx + " < " + Vy + "; " + Vx + " = " + Vy + " - " + Vx + ";";
+                case 0xE: return VF + " = " + Shifted + " >> 7; " + Vx + " = " + Shifted + " << 1;";
+            }
+            return "";
+        case 0xA000: return "I = " + Hex(nnn) + ";";
+        case 0xB000: NextPC = Hex(nnn) + " + " + (Quirks.JumpVx ? Vx : Reg(0)) + ";"; return "";
+        case 0xC000: return Vx + " = Chip8Random(Chip8) & " + Hex(kk) + ";";
+        case 0xD000: return VF + " = Chip8DrawSprite(Chip8, " + Vx + ", " + Vy + ", I, " + std::to_string(n) + ", " + (Quirks.WrapSprites ? "true" : "false") + ");";
+        case 0xE000:
+            if (kk == 0x9E) NextPC = "(Chip8->Chip8KeyPad >> (" + Vx + " & 0xF) & 1) != 0 ? " + Skip;
+            if (kk == 0xA1) NextPC = "(Chip8->Chip8KeyPad >> (" + Vx + " & 0xF) & 1) == 0 ? " + Skip;
+            return kk == 0x9E || kk == 0xA1 ? "Chip8->KeyPolled = 1;" : "";
+        case 0xF000:
+            switch (kk) {
+                case 0x07: return Vx + " = Chip8DelayTimer(Chip8);";
+                case 0x15: return "Chip8SetDelayTimer(Chip8, " + Vx + ");";
+                case 0x18: return "Chip8SetSoundTimer(Chip8, " + Vx + ");";
+                case 0x1E: return "I = (I + " + Vx + ") & 0xFFF;";
+                case 0x29: return "I = 0x50 + (" + Vx + " & 0xF) * 5;";
+                case 0x33:
+                    return "Chip8->Chip8Memory[I] = " + Vx + " / 100; Chip8->Chip8Memory[(I + 1) & 0xFFF] = (" + Vx + " / 10) % 10; Chip8->Chip8Memory[(I + 2) & 0xFFF] = " + Vx + " % 10; Chip8InvalidateCode(Chip8, I, 3);";
+                case 0x55: {
+                    std::string Code;
+                    for (int i = 0; i <= x; i++) {
+                        Code += "Chip8->Chip8Memory[(I + " + std::to_string(i) + ") & 0xFFF] = " + Reg(i) + "; ";
+                    }
+                    return Code + "Chip8InvalidateCode(Chip8, I, " + std::to_string(x + 1) + ");" + (LoadStoreI.empty() ? "" : " " + LoadStoreI);
+                }
+                case 0x65: {
+                    std::string Code;
+                    for (int i = 0; i <= x; i++) {
+                        Code += Reg(i) + " = Chip8->Chip8Memory[(I + " + std::to_string(i) + ") & 0xFFF]; ";
+                    }
+                    return Code + LoadStoreI;
+                }
+            }
+            return "";
+    }
+    return "";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: Chip8-AOT <rom.ch8> <output.cpp> [vip|chip48|schip|xochip]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int Profile = argc > 3 ? Chip8QuirksById(argv[3]) : Chip8QuirksForRom(argv[1]);
+    if (Profile < 0) {
+        std::cout << "Unknown quirk profile " << argv[3] << ", exiting...." << std::endl;
+        return EXIT_FAILURE;
+    }
+    Quirks = Chip8QuirkProfiles[Profile];
+
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file.is_open()) {
+        std::cout << "Unable to open ROM file, exiting...." << std::endl;
+        return EXIT_FAILURE;
+    }
+    file.read(reinterpret_cast<char*>(Memory) + 0x200, 3584);
+    int ROMSIZE = file.gcount();
+    if (ROMSIZE == 0) {
+        std::cout << "ROM file is empty, exiting...." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (file.peek() != EOF) {
+        std::cout << "ROM File too large to fit in memory (more than 3584 bytes), exiting...." << std::endl;
+        return EXIT_FAILURE;
+    }
+    file.close();
+
+    //Walk the control flow from the entry point, one block at a time.
+    std::vector<AOTBlock> Blocks;
+    std::set<uint16_t> Seen;
+    std::vector<uint16_t> Work = {0x200};
+    while (!Work.empty()) {
+        uint16_t Start = Work.back();
+        Work.pop_back();
+        if (Start < 0x200 || Start >= 4095 || Seen.count(Start)) {
+            continue;
+        }
+        Seen.insert(Start);
+
+        AOTBlock Block = {Start, Start, 0};
+        while (Block.Count < MaxBlockLength && Block.End < 4095) {
+            uint16_t opcode = Fetch(Block.End);
+            if (Interpreted(opcode)) {
+                Work.push_back(Block.End + 2); //Where the interpreter will carry on once the key arrives
+                break;
+            }
+            Block.End += 2;
+            Block.Count++;
+            if (EndsBlock(opcode)) {
+                Successors(opcode, Block.End - 2, Work);
+                break;
+            }
+        }
+        if (Block.Count == 0) {
+            continue;
+        }
+        if (Block.Count == MaxBlockLength) {
+            Work.push_back(Block.End);
+        }
+        Blocks.push_back(Block);
+    }
+
+    std::ostringstream Out;
+    Out << "//Generated by Chip8-AOT from " << argv[1] << ", do not edit." << std::endl;
+    Out << "#include \"chip8.h\"" << std::endl << std::endl;
+
+    for (const AOTBlock &Block : Blocks) {
+        std::vector<std::string> Lines;
+        std::string NextPC = Hex(Block.End) + ";";
+        for (uint16_t a = Block.Start; a < Block.End; a += 2) {
+            std::string Line = Translate(Fetch(a), a, NextPC);
+            char Comment[32];
+            snprintf(Comment, sizeof(Comment), "//%03X: %04X", a, Fetch(a));
+            Lines.push_back("    " + (Line.empty() ? "" : Line + " ") + Comment);
+        }
+
+        //Only the registers the block names are copied in and out.
+        std::string Code = NextPC;
+        for (const std::string &Line : Lines) {
+            Code += Line.substr(0, Line.find("//"));
+        }
+        bool Used[16];
+        for (int r = 0; r < 16; r++) {
+            Used[r] = Code.find(Reg(r)) != std::string::npos;
+        }
+
+        Out << "static void Chip8AOT_" << std::hex << std::uppercase << Block.Start << std::nouppercase << std::dec << "(Chip8System *Chip8) {" << std::endl;
+        for (int r = 0; r < 16; r++) {
+            if (Used[r]) Out << "    uint8_t " << Reg(r) << " = Chip8->V[" << r << "];" << std::endl;
+        }
+        Out << "    uint16_t I = Chip8->I;" << std::endl;
+        for (const std::string &Line : Lines) {
+            Out << Line << std::endl;
+        }
+        Out << "    uint16_t NextPC = " << NextPC << std::endl;
+        for (int r = 0; r < 16; r++) {
+            if (Used[r]) Out << "    Chip8->V[" << r << "] = " << Reg(r) << ";" << std::endl;
+        }
+        Out << "    Chip8->I = I;" << std::endl << "    Chip8->PC = NextPC;" << std::endl << "}" << std::endl << std::endl;
+    }
+
+    Out << "const Chip8AOTBlock Chip8AOTBlocks[] = {" << std::endl;
+    for (const AOTBlock &Block : Blocks) {
+        Out << "    {" << Hex(Block.Start) << ", " << Hex(Block.End) << ", " << Block.Count << ", Chip8AOT_" << std::hex << std::uppercase << Block.Start << std::nouppercase << std::dec << "}," << std::endl;
+    }
+    Out << "};" << std::endl;
+    Out << "const int Chip8AOTBlockCount = " << Blocks.size() << ";" << std::endl << std::endl;
+
+    //The ROM the blocks came from, so the emulator only uses them when the same ROM is loaded.
+    Out << "const uint8_t Chip8AOTRom[] = {";
+    for (int i = 0; i < ROMSIZE; i++) {
+        Out << (i % 16 == 0 ? "\n    " : " ") << (int)Memory[0x200 + i] << ",";
+    }
+    Out << std::endl << "};" << std::endl;
+    Out << "const int Chip8AOTRomSize = " << ROMSIZE << ";" << std::endl;
+    Out << "const int Chip8AOTQuirks = " << Profile << "; //" << Quirks.Name << std::endl;
+
+    std::ofstream Output(argv[2]);
+    if (!Output.is_open()) {
+        std::cout << "Unable to write " << argv[2] << ", exiting...." << std::endl;
+        return EXIT_FAILURE;
+    }
+    Output << Out.str();
+    std::cout << "Wrote " << Blocks.size() << " blocks to " << argv[2] << std::endl;
+    return EXIT_SUCCESS;
+}
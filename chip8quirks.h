@@ -0,0 +1,62 @@
+#ifndef CHIP8QUIRKS_H
+#define CHIP8QUIRKS_H
+
+//Quirk Profiles
+//The interpreters Chip-8 ROMs were written for disagree on a handful of opcodes, each profile is one of those behaviors.
+//The cores take the profile as a template parameter, so every profile compiles to its own interpreter with no quirk checks at run time.
+//Kept apart from chip8.h so Chip8-AOT can use it without SDL.
+#include <cstdint>
+#include <cctype>
+#include <string>
+
+enum Chip8QuirkProfile {
+    CHIP8_QUIRKS_VIP = 0, //COSMAC VIP, the original interpreter
+    CHIP8_QUIRKS_CHIP48 = 1, //CHIP-48 on the HP-48 calculators
+    CHIP8_QUIRKS_SCHIP = 2, //SUPER-CHIP 1.1
+    CHIP8_QUIRKS_XOCHIP = 3 //XO-CHIP, as run by Octo
+};
+#define CHIP8_QUIRK_PROFILES 4
+
+struct Chip8Quirks {
+    const char *Id; //Short name used on the command line
+    const char *Name;
+    bool ResetVF; //8xy1, 8xy2 and 8xy3 clear VF
+    bool ShiftVy; //8xy6 and 8xyE shift Vy into Vx, instead of shifting Vx in place
+    uint8_t LoadStoreI; //What Fx55 and Fx65 add to I, 0 nothing, 1 x, 2 x + 1
+    bool JumpVx; //Bnnn jumps to nnn + Vx, x being the top nibble of nnn, instead of nnn + V0
+    bool WrapSprites; //Dxyn wraps sprites around the edges of the screen instead of clipping them
+};
+
+constexpr Chip8Quirks Chip8QuirkProfiles[CHIP8_QUIRK_PROFILES] = {
+    {"vip", "COSMAC VIP", true, true, 2, false, false},
+    {"chip48", "CHIP-48", false, false, 1, true, false},
+    {"schip", "SUPER-CHIP", false, false, 0, true, false},
+    {"xochip", "XO-CHIP", false, true, 2, false, true}
+};
+
+//Picks the profile from the ROM's file extension, .sc8 for SUPER-CHIP, .xo8 for XO-CHIP, and the COSMAC VIP for .ch8 and anything else.
+inline int Chip8QuirksForRom(const std::string &ROMName) {
+    std::string Extension = ROMName.substr(ROMName.find_last_of('.') + 1);
+    for (char &c : Extension) {
+        c = tolower(c);
+    }
+    if (Extension == "sc8") {
+        return CHIP8_QUIRKS_SCHIP;
+    }
+    if (Extension == "xo8") {
+        return CHIP8_QUIRKS_XOCHIP;
+    }
+    return CHIP8_QUIRKS_VIP;
+}
+
+//Looks a profile up by its Id, -1 if there is none.
+inline int Chip8QuirksById(const std::string &Id) {
+    for (int p = 0; p < CHIP8_QUIRK_PROFILES; p++) {
+        if (Id == Chip8QuirkProfiles[p].Id) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+#endif